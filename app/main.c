@@ -0,0 +1,5 @@
+#include "../src/lab.h"
+
+int main(int argc, char **argv) {
+    return myMain(argc, argv);
+}
@@ -0,0 +1,105 @@
+/**
+ * Cost per buffer of allocating and freeing equal sized buffers one call at
+ * a time versus one buddy_malloc_batch/buddy_free_batch call, the way a
+ * packet pipeline grabs and releases 32-256 buffers at once. Every round
+ * frees all of its buffers so the pool has to split fresh blocks each time.
+ *
+ * usage: bench-batch [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/lab.h"
+
+#define MAX_COUNT 256
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Run rounds of count allocations of size bytes.
+ * @return ns spent allocating per buffer, the free time goes to *freed
+ */
+static double run(struct buddy_pool *pool, size_t size, size_t count, size_t rounds, bool batch,
+                  double *freed)
+{
+  void *out[MAX_COUNT];
+  uint64_t spent = 0;
+  uint64_t spent_free = 0;
+  for (size_t r = 0; r < rounds; r++)
+    {
+      uint64_t start = now_ns();
+      if (batch)
+        {
+          if (buddy_malloc_batch(pool, size, count, out) != count)
+            {
+              perror("buddy_malloc_batch");
+              exit(EXIT_FAILURE);
+            }
+        }
+      else
+        {
+          for (size_t i = 0; i < count; i++)
+            {
+              if (!(out[i] = buddy_malloc(pool, size)))
+                {
+                  perror("buddy_malloc");
+                  exit(EXIT_FAILURE);
+                }
+            }
+        }
+      spent += now_ns() - start;
+      start = now_ns();
+      if (batch)
+        {
+          buddy_free_batch(pool, out, count);
+        }
+      else
+        {
+          for (size_t i = 0; i < count; i++)
+            {
+              buddy_free(pool, out[i]);
+            }
+        }
+      spent_free += now_ns() - start;
+    }
+  *freed = (double)spent_free / (double)(rounds * count);
+  return (double)spent / (double)(rounds * count);
+}
+
+int main(int argc, char **argv)
+{
+  size_t rounds = argc > 1 ? (size_t)atol(argv[1]) : 20000;
+  size_t counts[] = { 32, 128, 256 };
+  struct
+  {
+    const char *name;
+    unsigned int flags;
+  } modes[] = {
+    { "header", 0 },
+    { "no header", BUDDY_NO_HEADER },
+  };
+
+  printf("%-10s %6s %6s %12s %12s %12s %12s\n", "mode", "size", "count",
+         "loop alloc", "batch alloc", "loop free", "batch free");
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+      struct buddy_options opts = { .flags = modes[m].flags };
+      for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+        {
+          struct buddy_pool pool;
+          buddy_init_opts(&pool, UINT64_C(1) << 30, &opts);
+          double loop_free, batch_free;
+          double loop = run(&pool, 2000, counts[c], rounds, false, &loop_free);
+          double batch = run(&pool, 2000, counts[c], rounds, true, &batch_free);
+          printf("%-10s %6d %6zu %12.1f %12.1f %12.1f %12.1f\n", modes[m].name, 2000, counts[c],
+                 loop, batch, loop_free, batch_free);
+          buddy_destroy(&pool);
+        }
+    }
+  return 0;
+}
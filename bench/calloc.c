@@ -0,0 +1,80 @@
+/**
+ * Cost of zeroed tables from a fresh pool with and without
+ * BUDDY_TRACK_ZERO. Each run fills a new pool with buddy_calloc tables of
+ * one size and reports the time per table and how many MiB ended up
+ * resident.
+ *
+ * usage: bench-calloc [pool order]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "../src/lab.h"
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * MiB of the pool that are backed by physical pages.
+ */
+static double resident_mib(struct buddy_pool *pool)
+{
+  size_t pages = pool->numbytes / 4096;
+  unsigned char *vec = malloc(pages);
+  if (!vec || mincore(pool->base, pool->numbytes, vec) != 0)
+    {
+      perror("mincore");
+      exit(EXIT_FAILURE);
+    }
+  size_t resident = 0;
+  for (size_t i = 0; i < pages; i++)
+    {
+      resident += vec[i] & 1;
+    }
+  free(vec);
+  return (double)resident * 4096 / (1 << 20);
+}
+
+/**
+ * Fill a fresh pool with size byte tables.
+ * @return us per table, the resident MiB of the pool go to *rss
+ */
+static double fill(unsigned int flags, size_t k, size_t size, double *rss)
+{
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = flags };
+  buddy_init_opts(&pool, UINT64_C(1) << k, &opts);
+  size_t count = 0;
+  uint64_t start = now_ns();
+  while (buddy_calloc(&pool, 1, size))
+    {
+      count++;
+    }
+  uint64_t spent = now_ns() - start;
+  *rss = resident_mib(&pool);
+  buddy_destroy(&pool);
+  return (double)spent / 1e3 / (double)count;
+}
+
+int main(int argc, char **argv)
+{
+  size_t k = argc > 1 ? (size_t)atol(argv[1]) : 28;
+  size_t sizes[] = { 4096, 65536, (size_t)1 << 20 };
+
+  printf("%-10s %10s %14s %14s %14s %14s\n", "size", "pool MiB",
+         "tracked us", "tracked MiB", "plain us", "plain MiB");
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+      double rss_tracked, rss_plain;
+      double tracked = fill(BUDDY_TRACK_ZERO | BUDDY_NO_HEADER, k, sizes[i], &rss_tracked);
+      double plain = fill(BUDDY_NO_HEADER, k, sizes[i], &rss_plain);
+      printf("%-10zu %10zu %14.2f %14.1f %14.2f %14.1f\n", sizes[i], ((size_t)1 << k) >> 20,
+             tracked, rss_tracked, plain, rss_plain);
+    }
+  return 0;
+}
@@ -0,0 +1,139 @@
+/**
+ * Container churn with the default allocator, buddy::allocator and
+ * buddy::memory_resource. Each round grows a std::vector by push_back,
+ * fills a std::unordered_map and a std::map with random keys and erases
+ * half of them again, then throws all of it away. The pool uses
+ * BUDDY_NO_HEADER | BUDDY_SLAB, so the small map nodes come from slabs.
+ * Reports the ns per element of each container.
+ *
+ * usage: bench-containers [elements in thousands] [rounds]
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include "../src/lab.hpp"
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+struct timings
+{
+  double vector_ns;
+  double unordered_ns;
+  double map_ns;
+};
+
+/**
+ * Run the churn on containers made by make_vector, make_unordered and
+ * make_map.
+ * @return ns per element for each container
+ */
+template <typename MakeVector, typename MakeUnordered, typename MakeMap>
+static timings churn(size_t n, size_t rounds, MakeVector make_vector,
+                     MakeUnordered make_unordered, MakeMap make_map)
+{
+  uint64_t spent[3] = { 0, 0, 0 };
+  uint64_t sum = 0;
+  for (size_t r = 0; r < rounds; r++)
+    {
+      srand(13);
+      uint64_t start = now_ns();
+      {
+        auto v = make_vector();
+        for (size_t i = 0; i < n; i++)
+          {
+            v.push_back((int)i);
+          }
+        sum += v.size();
+      }
+      uint64_t mid = now_ns();
+      spent[0] += mid - start;
+
+      {
+        auto u = make_unordered();
+        for (size_t i = 0; i < n; i++)
+          {
+            u[rand()] = (int)i;
+          }
+        for (size_t i = 0; i < n / 2; i++)
+          {
+            u.erase(rand());
+          }
+        sum += u.size();
+      }
+      uint64_t end = now_ns();
+      spent[1] += end - mid;
+
+      srand(13);
+      {
+        auto m = make_map();
+        for (size_t i = 0; i < n; i++)
+          {
+            m[rand()] = (int)i;
+          }
+        for (size_t i = 0; i < n / 2; i++)
+          {
+            m.erase(rand());
+          }
+        sum += m.size();
+      }
+      spent[2] += now_ns() - end;
+    }
+  if (sum == 0)
+    {
+      printf("unexpected sum\n");
+    }
+  double ops = (double)(n * rounds);
+  return { (double)spent[0] / ops, (double)spent[1] / ops, (double)spent[2] / ops };
+}
+
+static void report(const char *name, timings t)
+{
+  printf("%-18s %12.1f %14.1f %10.1f\n", name, t.vector_ns, t.unordered_ns, t.map_ns);
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = (argc > 1 ? (size_t)atol(argv[1]) : 200) * 1000;
+  size_t rounds = argc > 2 ? (size_t)atol(argv[2]) : 10;
+
+  struct buddy_pool pool;
+  struct buddy_options opts = {};
+  opts.flags = BUDDY_NO_HEADER | BUDDY_SLAB;
+  buddy_init_opts(&pool, 0, &opts);
+
+  printf("%-18s %12s %14s %10s\n", "allocator", "vector ns", "unordered ns", "map ns");
+  report("std::allocator",
+         churn(n, rounds, [] { return std::vector<int>(); },
+               [] { return std::unordered_map<int, int>(); },
+               [] { return std::map<int, int>(); }));
+
+  buddy::allocator<int> alloc(&pool);
+  using pair_alloc = buddy::allocator<std::pair<const int, int>>;
+  report("buddy::allocator",
+         churn(n, rounds, [&] { return std::vector<int, buddy::allocator<int>>(alloc); },
+               [&] {
+                 return std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                                           pair_alloc>(pair_alloc(alloc));
+               },
+               [&] { return std::map<int, int, std::less<int>, pair_alloc>(pair_alloc(alloc)); }));
+
+  buddy::memory_resource res(&pool);
+  report("pmr buddy",
+         churn(n, rounds, [&] { return std::pmr::vector<int>(&res); },
+               [&] { return std::pmr::unordered_map<int, int>(&res); },
+               [&] { return std::pmr::map<int, int>(&res); }));
+
+  buddy_destroy(&pool);
+  return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * An index of pool resident nodes kept as 8 byte pointers versus 32 bit
+ * handles. Both index the same nodes. Reports the size of each index and
+ * the time of a random lookup through it, including the decode.
+ *
+ * usage: bench-handles [nodes in thousands]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/lab.h"
+
+struct node
+{
+  uint64_t key;
+  uint64_t value;
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+  size_t count = (argc > 1 ? (size_t)atol(argv[1]) : 4000) * 1000;
+  size_t lookups = 20000000;
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_NO_HEADER };
+  buddy_init_opts(&pool, count * 64 * 2, &opts);
+
+  struct node **ptrs = malloc(count * sizeof(*ptrs));
+  buddy_handle32_t *handles = malloc(count * sizeof(*handles));
+  if (!ptrs || !handles)
+    {
+      perror("malloc");
+      return EXIT_FAILURE;
+    }
+  for (size_t i = 0; i < count; i++)
+    {
+      handles[i] = buddy_malloc_handle(&pool, sizeof(struct node));
+      if (handles[i] == BUDDY_HANDLE_NULL)
+        {
+          perror("buddy_malloc_handle");
+          return EXIT_FAILURE;
+        }
+      ptrs[i] = buddy_handle_decode(&pool, handles[i]);
+      ptrs[i]->key = i;
+      ptrs[i]->value = i * 3;
+    }
+
+  uint64_t x = 88172645463325252u;
+  uint64_t sum = 0;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < lookups; i++)
+    {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      sum += ptrs[x % count]->value;
+    }
+  double ptr_ns = (double)(now_ns() - start) / (double)lookups;
+
+  x = 88172645463325252u;
+  start = now_ns();
+  for (size_t i = 0; i < lookups; i++)
+    {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      sum -= ((struct node *)buddy_handle_decode(&pool, handles[x % count]))->value;
+    }
+  double handle_ns = (double)(now_ns() - start) / (double)lookups;
+  if (sum != 0)
+    {
+      printf("lookups disagree\n");
+    }
+
+  printf("%-10s %12s %12s\n", "index", "MiB", "ns/lookup");
+  printf("%-10s %12.1f %12.1f\n", "pointer", (double)(count * sizeof(*ptrs)) / (1 << 20), ptr_ns);
+  printf("%-10s %12.1f %12.1f\n", "handle", (double)(count * sizeof(*handles)) / (1 << 20), handle_ns);
+  free(ptrs);
+  free(handles);
+  buddy_destroy(&pool);
+  return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * Random access throughput over allocated blocks with normal pages,
+ * transparent huge pages and MAP_HUGETLB pages. Each run fills most of a
+ * fresh pool with 64KiB buffers, touches them and then reads random words
+ * from random buffers, the access pattern of a large hash table or index.
+ * The backing column shows what the pool actually got, a pool falls back
+ * to normal pages when the system has no huge pages to give.
+ *
+ * usage: bench-hugepages [pool order] [reads in millions]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/lab.h"
+
+#define BUF_SIZE 65536
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static const char *backing(unsigned int flags)
+{
+  if (flags & BUDDY_HUGETLB)
+    {
+      return "hugetlb";
+    }
+  return (flags & BUDDY_THP) ? "thp" : "4KiB";
+}
+
+/**
+ * Fill a 2^k pool and read reads random words from it.
+ * @return million reads per second
+ */
+static double run(unsigned int flags, size_t k, size_t reads, const char **got)
+{
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = flags | BUDDY_NO_HEADER };
+  buddy_init_opts(&pool, UINT64_C(1) << k, &opts);
+  *got = backing(pool.flags);
+
+  size_t max = (((size_t)1 << k) / BUF_SIZE) * 7 / 8;
+  uint64_t **bufs = malloc(max * sizeof(*bufs));
+  size_t n = 0;
+  while (n < max && (bufs[n] = buddy_malloc(&pool, BUF_SIZE)))
+    {
+      memset(bufs[n++], 1, BUF_SIZE);
+    }
+
+  uint64_t x = 88172645463325252u;
+  uint64_t sum = 0;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < reads; i++)
+    {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      sum += bufs[(x >> 20) % n][x % (BUF_SIZE / sizeof(uint64_t))];
+    }
+  double secs = (double)(now_ns() - start) / 1e9;
+  if (sum == 0)
+    {
+      printf("unexpected sum\n");
+    }
+  free(bufs);
+  buddy_destroy(&pool);
+  return (double)reads / 1e6 / secs;
+}
+
+int main(int argc, char **argv)
+{
+  size_t k = argc > 1 ? (size_t)atol(argv[1]) : 30;
+  size_t reads = (argc > 2 ? (size_t)atol(argv[2]) : 50) * 1000000;
+  struct
+  {
+    const char *name;
+    unsigned int flags;
+  } modes[] = {
+    { "normal", 0 },
+    { "thp", BUDDY_THP },
+    { "hugetlb", BUDDY_HUGETLB },
+  };
+
+  printf("%-10s %10s %10s %14s\n", "mode", "pool MiB", "backing", "Mreads/s");
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+      const char *got;
+      double rate = run(modes[m].flags, k, reads, &got);
+      printf("%-10s %10zu %10s %14.1f\n", modes[m].name, ((size_t)1 << k) >> 20, got, rate);
+    }
+  return 0;
+}
@@ -0,0 +1,59 @@
+/**
+ * Startup time of a prefaulted pool by number of init threads. Each run
+ * creates a fresh pool with BUDDY_PREFAULT, so buddy_init_opts faults in
+ * every page, and then destroys it again. With out of line metadata the
+ * side table is faulted in too.
+ *
+ * usage: bench-init [pool order]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/lab.h"
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @return ms spent in buddy_init_opts
+ */
+static double init_ms(unsigned int flags, size_t k, size_t threads)
+{
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = flags | BUDDY_PREFAULT, .init_threads = threads };
+  uint64_t start = now_ns();
+  buddy_init_opts(&pool, UINT64_C(1) << k, &opts);
+  double ms = (double)(now_ns() - start) / 1e6;
+  buddy_destroy(&pool);
+  return ms;
+}
+
+int main(int argc, char **argv)
+{
+  size_t k = argc > 1 ? (size_t)atol(argv[1]) : 30;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads[] = { 1, 2, 4, 8, BUDDY_INIT_THREADS_PER_CPU };
+
+  printf("%zu MiB pool, %ld CPUs\n", ((size_t)1 << k) >> 20, cpus);
+  printf("%-10s %12s %14s\n", "threads", "header ms", "no header ms");
+  for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+    {
+      char name[24];
+      if (threads[i] == BUDDY_INIT_THREADS_PER_CPU)
+        {
+          snprintf(name, sizeof(name), "per cpu");
+        }
+      else
+        {
+          snprintf(name, sizeof(name), "%zu", threads[i]);
+        }
+      printf("%-10s %12.1f %14.1f\n", name, init_ms(0, k, threads[i]),
+             init_ms(BUDDY_NO_HEADER, k, threads[i]));
+    }
+  return 0;
+}
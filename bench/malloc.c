@@ -0,0 +1,88 @@
+/**
+ * Plain malloc/free churn, for comparing glibc with the preload library:
+ *
+ *   ./bench-malloc
+ *   LD_PRELOAD=./libbuddy.so ./bench-malloc
+ *
+ * Every thread keeps a working set of slots and replaces a random slot
+ * with a buffer of a random size each step, mostly small strings and
+ * nodes with the odd buffer up to 64KiB. Every eighth step goes through
+ * realloc instead. Reports the time per operation and the peak RSS of the
+ * process.
+ *
+ * usage: bench-malloc [threads] [ops per thread in millions]
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define SLOTS 16384
+
+static size_t ops;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void *churn(void *arg)
+{
+  uint64_t x = 88172645463325252u + (uintptr_t)arg;
+  void **slots = calloc(SLOTS, sizeof(*slots));
+  for (size_t i = 0; i < ops; i++)
+    {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      size_t slot = x % SLOTS;
+      // 15 in 16 requests are 16B-1KiB, the rest up to 64KiB
+      size_t size = ((x >> 20) & 15) ? 16 + (x >> 32) % 1008 : 1024 + (x >> 32) % 64512;
+      if ((x >> 24) % 8 == 0 && slots[slot])
+        {
+          slots[slot] = realloc(slots[slot], size);
+        }
+      else
+        {
+          free(slots[slot]);
+          slots[slot] = malloc(size);
+        }
+      memset(slots[slot], 1, size < 64 ? size : 64);
+    }
+  for (size_t i = 0; i < SLOTS; i++)
+    {
+      free(slots[i]);
+    }
+  free(slots);
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  size_t threads = argc > 1 ? (size_t)atol(argv[1]) : 4;
+  ops = (argc > 2 ? (size_t)atol(argv[2]) : 5) * 1000000;
+  pthread_t *tid = malloc(threads * sizeof(*tid));
+
+  uint64_t start = now_ns();
+  for (size_t t = 0; t < threads; t++)
+    {
+      pthread_create(&tid[t], NULL, churn, (void *)(uintptr_t)t);
+    }
+  for (size_t t = 0; t < threads; t++)
+    {
+      pthread_join(tid[t], NULL);
+    }
+  double ns = (double)(now_ns() - start) / (double)(ops * threads);
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%-10s %10s %12s\n", "threads", "ns/op", "max RSS MiB");
+  printf("%-10zu %10.1f %12.1f\n", threads, ns, (double)ru.ru_maxrss / 1024);
+  free(tid);
+  return 0;
+}
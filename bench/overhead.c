@@ -0,0 +1,77 @@
+/**
+ * Memory overhead of power-of-two requests with and without the per block
+ * header, and with small requests served from slabs. Each run fills a fresh
+ * pool with requests of one size until buddy_malloc fails and reports how
+ * much of the pool ended up holding requested bytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/lab.h"
+
+#define POOL_K 28
+
+/**
+ * Fill a pool with size byte requests.
+ * @return the fraction of the pool handed to the caller as requested bytes
+ */
+static double fill(unsigned int flags, size_t size)
+{
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = flags };
+  buddy_init_opts(&pool, UINT64_C(1) << POOL_K, &opts);
+  size_t count = 0;
+  while (buddy_malloc(&pool, size))
+    {
+      count++;
+    }
+  double used = (double)(count * size) / (double)pool.numbytes;
+  buddy_destroy(&pool);
+  return used;
+}
+
+/**
+ * Fill a pool with a random mix of power-of-two requests from 16B to 64KiB.
+ */
+static double fill_mixed(unsigned int flags)
+{
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = flags };
+  buddy_init_opts(&pool, UINT64_C(1) << POOL_K, &opts);
+  srand(42);
+  size_t requested = 0;
+  for (;;)
+    {
+      size_t size = (size_t)1 << (4 + rand() % 13);
+      if (!buddy_malloc(&pool, size))
+        {
+          break;
+        }
+      requested += size;
+    }
+  double used = (double)requested / (double)pool.numbytes;
+  buddy_destroy(&pool);
+  return used;
+}
+
+int main(void)
+{
+  printf("%-10s %12s %12s %12s\n", "request", "header", "no header", "slab");
+  for (int j = 3; j <= 20; j++)
+    {
+      size_t size = (size_t)1 << j;
+      printf("%-10zu %11.1f%% %11.1f%% %11.1f%%\n", size,
+             100.0 * fill(0, size), 100.0 * fill(BUDDY_NO_HEADER, size),
+             100.0 * fill(BUDDY_SLAB | BUDDY_NO_HEADER, size));
+    }
+  size_t odd[] = { 24, 48 };
+  for (int j = 0; j < 2; j++)
+    {
+      printf("%-10zu %11.1f%% %11.1f%% %11.1f%%\n", odd[j],
+             100.0 * fill(0, odd[j]), 100.0 * fill(BUDDY_NO_HEADER, odd[j]),
+             100.0 * fill(BUDDY_SLAB | BUDDY_NO_HEADER, odd[j]));
+    }
+  printf("%-10s %11.1f%% %11.1f%% %11.1f%%\n", "mixed",
+         100.0 * fill_mixed(0), 100.0 * fill_mixed(BUDDY_NO_HEADER),
+         100.0 * fill_mixed(BUDDY_SLAB | BUDDY_NO_HEADER));
+  return 0;
+}
@@ -0,0 +1,82 @@
+/**
+ * Page faults and allocation latency on the hot path of a fresh pool with
+ * and without BUDDY_PREFAULT and BUDDY_MLOCK. Each run times buddy_init_opts,
+ * then fills most of the pool with buffers of random sizes from 4KiB to
+ * 64KiB and writes each one right after allocating it. Reports the minor
+ * and major faults taken during the fill (from getrusage) and the median,
+ * p99 and worst time of one malloc plus first write.
+ *
+ * usage: bench-prefault [pool order]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "../src/lab.h"
+
+#define MAX_BUFS 262144
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void run(const char *name, unsigned int flags, size_t k)
+{
+  static uint64_t lat[MAX_BUFS];
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = flags | BUDDY_NO_HEADER };
+  uint64_t start = now_ns();
+  buddy_init_opts(&pool, UINT64_C(1) << k, &opts);
+  double init_ms = (double)(now_ns() - start) / 1e6;
+  if ((flags & BUDDY_MLOCK) && !(pool.flags & BUDDY_MLOCK))
+    {
+      printf("%-16s could not lock the pool, raise RLIMIT_MEMLOCK\n", name);
+    }
+
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+  srand(11);
+  size_t n = 0, used = 0;
+  while (n < MAX_BUFS && used < ((size_t)7 << (k - 3)))
+    {
+      size_t size = (size_t)1 << (12 + rand() % 5);
+      uint64_t t = now_ns();
+      char *p = buddy_malloc(&pool, size);
+      if (!p)
+        {
+          break;
+        }
+      memset(p, 1, size);
+      lat[n++] = now_ns() - t;
+      used += size;
+    }
+  getrusage(RUSAGE_SELF, &after);
+
+  qsort(lat, n, sizeof(lat[0]), cmp_u64);
+  printf("%-16s %10.1f %10ld %8ld %10.1f %10.1f %10.1f\n", name, init_ms,
+         after.ru_minflt - before.ru_minflt, after.ru_majflt - before.ru_majflt,
+         (double)lat[n / 2] / 1e3, (double)lat[n * 99 / 100] / 1e3, (double)lat[n - 1] / 1e3);
+  buddy_destroy(&pool);
+}
+
+int main(int argc, char **argv)
+{
+  size_t k = argc > 1 ? (size_t)atol(argv[1]) : 28;
+  printf("%-16s %10s %10s %8s %10s %10s %10s\n", "mode", "init ms", "minflt", "majflt",
+         "p50 us", "p99 us", "max us");
+  run("lazy", 0, k);
+  run("prefault", BUDDY_PREFAULT, k);
+  run("prefault+mlock", BUDDY_PREFAULT | BUDDY_MLOCK, k);
+  return 0;
+}
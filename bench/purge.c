@@ -0,0 +1,98 @@
+/**
+ * Resident memory after a load spike with and without purging. Each round
+ * fills most of the pool with buffers of random power-of-two sizes,
+ * touches them and frees them all again. Reports the time per round, the
+ * pool's resident MiB after the last round and the purge counters. With a
+ * decay window the memory is reused before it decays, the RSS is taken
+ * once the window has passed after the last round.
+ *
+ * usage: bench-purge [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "../src/lab.h"
+
+#define POOL_K 28
+#define MAX_BUFS 65536
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static double resident_mib(struct buddy_pool *pool)
+{
+  size_t pages = pool->numbytes / 4096;
+  unsigned char *vec = malloc(pages);
+  if (!vec || mincore(pool->base, pool->numbytes, vec) != 0)
+    {
+      perror("mincore");
+      exit(EXIT_FAILURE);
+    }
+  size_t resident = 0;
+  for (size_t i = 0; i < pages; i++)
+    {
+      resident += vec[i] & 1;
+    }
+  free(vec);
+  return (double)resident * 4096 / (1 << 20);
+}
+
+static void run(const char *name, unsigned int flags, size_t purge_order, size_t decay_ms,
+                size_t rounds)
+{
+  static void *bufs[MAX_BUFS];
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = flags, .purge_order = purge_order,
+                                .purge_decay_ms = decay_ms };
+  buddy_init_opts(&pool, UINT64_C(1) << POOL_K, &opts);
+  srand(7);
+  uint64_t start = now_ns();
+  for (size_t r = 0; r < rounds; r++)
+    {
+      size_t n = 0, used = 0;
+      while (n < MAX_BUFS && used < ((size_t)3 << (POOL_K - 2)))
+        {
+          size_t size = (size_t)1 << (12 + rand() % 9);
+          if (!(bufs[n] = buddy_malloc(&pool, size)))
+            {
+              break;
+            }
+          memset(bufs[n++], 1, size);
+          used += size;
+        }
+      for (size_t i = 0; i < n; i++)
+        {
+          buddy_free(&pool, bufs[i]);
+        }
+    }
+  double ms = (double)(now_ns() - start) / 1e6 / (double)rounds;
+  if (decay_ms)
+    {
+      usleep((useconds_t)(decay_ms * 2000));
+    }
+  struct buddy_stats st;
+  buddy_stats(&pool, &st);
+  printf("%-14s %10.1f %12.1f %12.1f %10zu %12zu\n", name, ms, resident_mib(&pool),
+         (double)st.purged_bytes / (1 << 20), st.purges, st.reused_purged_pages);
+  buddy_destroy(&pool);
+}
+
+int main(int argc, char **argv)
+{
+  size_t rounds = argc > 1 ? (size_t)atol(argv[1]) : 5;
+  printf("%-14s %10s %12s %12s %10s %12s\n", "mode", "ms/round", "RSS MiB",
+         "purged MiB", "purges", "reused pages");
+  run("no purge", BUDDY_NO_HEADER, 0, 0, rounds);
+  run("dontneed 2MiB", BUDDY_NO_HEADER, 21, 0, rounds);
+  run("dontneed 64K", BUDDY_NO_HEADER, 16, 0, rounds);
+  run("free 2MiB", BUDDY_NO_HEADER | BUDDY_PURGE_LAZY, 21, 0, rounds);
+  run("decay 2MiB", BUDDY_NO_HEADER, 21, 500, rounds);
+  return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * Growing a buffer by doubling it with buddy_realloc, the way a vector or
+ * log builder grows. A second, small allocation is made after every step
+ * so the buffer can not simply absorb its upper buddy in the pool, which
+ * forces a copy there. Above mmap_threshold the buffer lives in its own
+ * mapping and mremap moves its pages instead.
+ *
+ * usage: bench-realloc [final size order]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/lab.h"
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Grow a buffer from 4KiB to 2^top bytes.
+ * @return ms spent in buddy_realloc
+ */
+static double grow(size_t threshold, size_t top)
+{
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_NO_HEADER, .mmap_threshold = threshold };
+  buddy_init_opts(&pool, UINT64_C(1) << (top + 2), &opts);
+  char *buf = buddy_malloc(&pool, 4096);
+  memset(buf, 1, 4096);
+  uint64_t spent = 0;
+  for (size_t size = 8192; size <= ((size_t)1 << top); size *= 2)
+    {
+      uint64_t start = now_ns();
+      buf = buddy_realloc(&pool, buf, size);
+      spent += now_ns() - start;
+      if (!buf || !buddy_malloc(&pool, 64))
+        {
+          perror("buddy_realloc");
+          exit(EXIT_FAILURE);
+        }
+      memset(buf + size / 2, 1, size / 2);
+    }
+  buddy_destroy(&pool);
+  return (double)spent / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+  size_t top = argc > 1 ? (size_t)atol(argv[1]) : 28;
+  printf("%-22s %12s\n", "mode", "realloc ms");
+  printf("%-22s %12.2f\n", "pool", grow(0, top));
+  printf("%-22s %12.2f\n", "mmap_threshold 1MiB", grow((size_t)1 << 20, top));
+  return 0;
+}
@@ -0,0 +1,158 @@
+/**
+ * Multi-threaded alloc/free throughput on one shared pool. Every thread
+ * keeps a window of live blocks and replaces a random one on each step, so
+ * half of the operations are frees and half are small allocations. Every
+ * SAMPLE-th step is timed on its own to get the p99 latency of a step.
+ *
+ * usage: bench-threads [max threads] [ops per thread]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/lab.h"
+
+#define WINDOW 256
+#define SAMPLE 8
+
+struct mode
+{
+  const char *name;
+  struct buddy_options opts;
+  bool wrap;                    /*Serialize every call on one global mutex*/
+};
+
+static const struct mode modes[] = {
+  { "global mutex", { 0 }, true },
+  { "thread safe", { .flags = BUDDY_THREAD_SAFE }, false },
+  { "thread cache", { .tcache_orders = 4 }, false },
+  { "cpu arenas", { .arenas = BUDDY_ARENAS_PER_CPU }, false },
+  { "arenas+cache", { .arenas = BUDDY_ARENAS_PER_CPU, .tcache_orders = 4 }, false },
+  { "lock free", { .flags = BUDDY_LOCK_FREE }, false },
+};
+
+static pthread_mutex_t global = PTHREAD_MUTEX_INITIALIZER;
+
+struct worker
+{
+  struct buddy_pool *pool;
+  const struct mode *mode;
+  size_t ops;
+  unsigned int seed;
+  pthread_t thread;
+  uint64_t *lat;                /*Sampled step latencies in ns*/
+};
+
+static void *do_malloc(const struct worker *w, size_t size)
+{
+  if (!w->mode->wrap)
+    {
+      return buddy_malloc(w->pool, size);
+    }
+  pthread_mutex_lock(&global);
+  void *mem = buddy_malloc(w->pool, size);
+  pthread_mutex_unlock(&global);
+  return mem;
+}
+
+static void do_free(const struct worker *w, void *mem)
+{
+  if (!w->mode->wrap)
+    {
+      buddy_free(w->pool, mem);
+      return;
+    }
+  pthread_mutex_lock(&global);
+  buddy_free(w->pool, mem);
+  pthread_mutex_unlock(&global);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void *run(void *arg)
+{
+  struct worker *w = arg;
+  void *live[WINDOW] = {0};
+  for (size_t i = 0; i < w->ops; i++)
+    {
+      int slot = rand_r(&w->seed) % WINDOW;
+      size_t size = 8 + (size_t)(rand_r(&w->seed) % 500);
+      uint64_t start = i % SAMPLE ? 0 : now_ns();
+      do_free(w, live[slot]);
+      live[slot] = do_malloc(w, size);
+      if (!(i % SAMPLE))
+        {
+          w->lat[i / SAMPLE] = now_ns() - start;
+        }
+      if (!live[slot])
+        {
+          perror("buddy_malloc");
+          exit(EXIT_FAILURE);
+        }
+    }
+  for (int i = 0; i < WINDOW; i++)
+    {
+      do_free(w, live[i]);
+    }
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+  int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+  size_t ops = argc > 2 ? (size_t)atol(argv[2]) : 1000000;
+  struct worker workers[64];
+  if (max_threads > 64)
+    {
+      max_threads = 64;
+    }
+
+  size_t samples = (ops + SAMPLE - 1) / SAMPLE;
+  uint64_t *lat = malloc((size_t)max_threads * samples * sizeof(uint64_t));
+  if (!lat)
+    {
+      perror("malloc");
+      return EXIT_FAILURE;
+    }
+
+  printf("%-14s %8s %14s %10s\n", "mode", "threads", "Mops/s", "p99 ns");
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+      for (int t = 1; t <= max_threads; t *= 2)
+        {
+          struct buddy_pool pool;
+          buddy_init_opts(&pool, UINT64_C(1) << 30, &modes[m].opts);
+          uint64_t start = now_ns();
+          for (int i = 0; i < t; i++)
+            {
+              workers[i] = (struct worker){ &pool, &modes[m], ops, (unsigned int)i + 1, 0,
+                                            lat + (size_t)i * samples };
+              pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+            }
+          for (int i = 0; i < t; i++)
+            {
+              pthread_join(workers[i].thread, NULL);
+            }
+          double secs = (double)(now_ns() - start) / 1e9;
+          size_t n = (size_t)t * samples;
+          qsort(lat, n, sizeof(uint64_t), cmp_u64);
+          printf("%-14s %8d %14.2f %10llu\n", modes[m].name, t,
+                 2.0 * (double)ops * t / secs / 1e6, (unsigned long long)lat[n * 99 / 100]);
+          buddy_destroy(&pool);
+        }
+    }
+  free(lat);
+  return 0;
+}
@@ -0,0 +1,321 @@
+/**
+ * A malloc replacement backed by a buddy pool, for running unmodified
+ * programs on the allocator:
+ *
+ *   LD_PRELOAD=./libbuddy.so ./some-program
+ *
+ * One global pool is made on the first call. It has no headers so every
+ * pointer is aligned to 64 bytes, one arena and one cache per CPU, grows by
+ * up to BUDDY_REGIONS_MAX regions and gives requests of PRELOAD_MMAP_MIN and
+ * up their own mapping. BUDDY_PRELOAD_K sets the order of the pool, it
+ * defaults to DEFAULT_K.
+ *
+ * Anything allocated while this thread is already inside the allocator,
+ * which happens when buddy_init_opts or the libc calls it makes need
+ * memory, comes from a static bootstrap buffer instead. That memory is
+ * never reused, free ignores it and realloc moves it into the pool. realloc
+ * moves memory the pool never handed out into it the same way.
+ */
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../src/lab.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define PRELOAD_MMAP_MIN ((size_t)32 << 20)
+#define PRELOAD_PURGE_K 21
+
+#define BOOT_SIZE ((size_t)1 << 20)
+#define BOOT_ALIGN 16
+
+static struct buddy_pool pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static bool pool_ready;
+
+// Set while this thread runs inside the allocator
+static __thread bool busy __attribute__((tls_model("initial-exec")));
+
+static _Alignas(4096) char boot[BOOT_SIZE];
+static size_t boot_used;
+
+/**
+ * Order of the pool from BUDDY_PRELOAD_K, DEFAULT_K if it is unset or out
+ * of range.
+ */
+static size_t pool_k(void) {
+    const char *env = getenv("BUDDY_PRELOAD_K");
+    if (!env) {
+        return DEFAULT_K;
+    }
+    char *end;
+    unsigned long k = strtoul(env, &end, 10);
+    if (*end != '\0' || k < MIN_K || k >= MAX_K) {
+        return DEFAULT_K;
+    }
+    return k;
+}
+
+static void fork_prepare(void) {
+    buddy_fork_prepare(&pool);
+}
+
+static void fork_parent(void) {
+    buddy_fork_parent(&pool);
+}
+
+static void fork_child(void) {
+    buddy_fork_child(&pool);
+}
+
+static void pool_init(void) {
+    struct buddy_options opts = {
+        .flags = BUDDY_NO_HEADER,
+        .arenas = BUDDY_ARENAS_PER_CPU,
+        .tcache_orders = BUDDY_TCACHE_ORDERS_MAX,
+        .mmap_threshold = PRELOAD_MMAP_MIN,
+        .max_regions = BUDDY_REGIONS_MAX,
+        .purge_order = PRELOAD_PURGE_K,
+    };
+    buddy_init_opts(&pool, UINT64_C(1) << pool_k(), &opts);
+    // A child forked while another thread holds a pool lock could never
+    // allocate again
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+    __atomic_store_n(&pool_ready, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Enter the allocator on this thread, making the pool on the first call.
+ * @return false if the thread is inside the allocator already and the
+ * request has to come from the bootstrap buffer
+ */
+static inline bool enter(void) {
+    if (busy) {
+        return false;
+    }
+    busy = true;
+    pthread_once(&pool_once, pool_init);
+    return true;
+}
+
+static inline void leave(void) {
+    busy = false;
+}
+
+static inline bool in_boot(void *ptr) {
+    return (uintptr_t)ptr - (uintptr_t)boot < BOOT_SIZE;
+}
+
+/**
+ * Carve size bytes aligned to alignment out of the bootstrap buffer. The
+ * size is kept in the word in front of the memory for realloc and
+ * malloc_usable_size. The buffer starts out zeroed and is never reused, so
+ * the memory is zeroed as well.
+ */
+static void *boot_alloc(size_t alignment, size_t size) {
+    if (alignment < BOOT_ALIGN) {
+        alignment = BOOT_ALIGN;
+    }
+    size_t used = __atomic_load_n(&boot_used, __ATOMIC_RELAXED);
+    size_t start;
+    do {
+        if (alignment > BOOT_SIZE || size > BOOT_SIZE) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        start = (used + BOOT_ALIGN + alignment - 1) & ~(alignment - 1);
+        if (start > BOOT_SIZE - size) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&boot_used, &used, start + size, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    ((size_t *)(boot + start))[-1] = size;
+    return boot + start;
+}
+
+static inline size_t boot_size(void *ptr) {
+    return ((size_t *)ptr)[-1];
+}
+
+/**
+ * The aligned allocation behind posix_memalign, aligned_alloc, memalign,
+ * valloc and pvalloc.
+ */
+static void *aligned(size_t alignment, size_t size) {
+    if (!enter()) {
+        return boot_alloc(alignment, size);
+    }
+    void *ptr = buddy_memalign(&pool, alignment, size ? size : 1);
+    leave();
+    return ptr;
+}
+
+EXPORT void *malloc(size_t size) {
+    if (!enter()) {
+        return boot_alloc(0, size);
+    }
+    // buddy_malloc(0) returns NULL, malloc(0) has to give a unique pointer
+    void *ptr = buddy_malloc(&pool, size ? size : 1);
+    leave();
+    return ptr;
+}
+
+/**
+ * Whether ptr came from the pool. Pointers freed before the pool exists or
+ * that it never handed out, from the dynamic loader or libc before the
+ * library was in place, are not ours to free.
+ */
+static inline bool pool_owns(void *ptr) {
+    return __atomic_load_n(&pool_ready, __ATOMIC_ACQUIRE) && buddy_owns(&pool, ptr);
+}
+
+EXPORT void free(void *ptr) {
+    if (!ptr || in_boot(ptr) || !__atomic_load_n(&pool_ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    // A free from inside the allocator leaks the block rather than
+    // entering the pool a second time
+    if (!enter()) {
+        return;
+    }
+    if (pool_owns(ptr)) {
+        buddy_free(&pool, ptr);
+    }
+    leave();
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!enter()) {
+        return boot_alloc(0, total);
+    }
+    void *ptr = buddy_calloc(&pool, 1, total ? total : 1);
+    leave();
+    return ptr;
+}
+
+/**
+ * How many of the len bytes from ptr are mapped, up to the first page
+ * that is not.
+ */
+static size_t mapped_bytes(void *ptr, size_t len) {
+    unsigned char vec;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)ptr;
+    uintptr_t next = (start | (page - 1)) + 1;
+    while (next - start < len) {
+        if (mincore((void *)next, page, &vec) != 0) {
+            return next - start;
+        }
+        next += page;
+    }
+    return len;
+}
+
+/**
+ * Move a block the pool never handed out into a new one. Its size is not
+ * known, so size bytes are copied, or as many as are mapped behind ptr.
+ * Anything past the old block is garbage the caller does not look at. The
+ * old block is left alone, it is not ours to free.
+ */
+static void *move_foreign(void *ptr, size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    void *new_ptr = malloc(size);
+    if (new_ptr) {
+        memcpy(new_ptr, ptr, mapped_bytes(ptr, size));
+    }
+    return new_ptr;
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return malloc(size);
+    }
+    if (in_boot(ptr)) {
+        if (size == 0) {
+            return NULL;
+        }
+        void *new_ptr = malloc(size);
+        if (new_ptr) {
+            size_t old_size = boot_size(ptr);
+            memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+        }
+        return new_ptr;
+    }
+    if (!enter()) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!pool_owns(ptr)) {
+        leave();
+        return move_foreign(ptr, size);
+    }
+    void *new_ptr = buddy_realloc(&pool, ptr, size);
+    leave();
+    return new_ptr;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    // posix_memalign reports errors in its return value and leaves errno be
+    int saved = errno;
+    void *ptr = aligned(alignment, size);
+    int err = errno;
+    errno = saved;
+    if (!ptr) {
+        return err;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    return aligned(alignment, size);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+    return aligned(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return aligned((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    if (in_boot(ptr)) {
+        return boot_size(ptr);
+    }
+    if (!__atomic_load_n(&pool_ready, __ATOMIC_ACQUIRE) || !enter()) {
+        return 0;
+    }
+    size_t size = pool_owns(ptr) ? buddy_usable_size(&pool, ptr) : 0;
+    leave();
+    return size;
+}
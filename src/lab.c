@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <sys/time.h>    /* for gettimeofday */
 #include <sys/mman.h>
@@ -5,176 +6,2936 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "lab.h"
 
 #ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS 0x20
 #endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/**
+ * btok for a pool whose allocations carry hdr bytes of header.
+ */
+static size_t hdr_btok(size_t bytes, size_t hdr) {
+    if (bytes == 0) {
+        return 0;
+    }
+    if (bytes > ((size_t)1 << (MAX_K - 1)) - hdr) {
+        return MAX_K;
+    }
+    bytes += hdr;
+    size_t k = SMALLEST_K;
+    size_t block_size = (size_t)1 << k;
+    while (block_size < bytes) {
+        k++;
+        block_size <<= 1;
+    }
+    return k;
+}
+
+size_t btok(size_t bytes) {
+    // Include the size of the header
+    return hdr_btok(bytes, sizeof(struct avail));
+}
+
+/* avail_bits must have a bit for every order */
+_Static_assert(MAX_K <= 64, "avail_bits is too small for MAX_K");
+
+#define BIT(k) (UINT64_C(1) << (k))
+
+/* Zero tracking and purging keep one bit per page of 2^PAGE_K bytes */
+#define PAGE_K 12
+
+/**
+ * Bits of pages first..last that fall into word w of a page bitmap.
+ */
+static inline uint64_t page_bits(size_t w, size_t first, size_t last) {
+    uint64_t bits = ~UINT64_C(0);
+    if (w == first / 64) {
+        bits &= ~UINT64_C(0) << (first % 64);
+    }
+    if (w == last / 64) {
+        bits &= ~UINT64_C(0) >> (63 - last % 64);
+    }
+    return bits;
+}
+
+/**
+ * Set the bits of pages first..last. Blocks of different threads share
+ * bitmap words, so the bits are set atomically.
+ */
+static void pages_set(uint64_t *map, size_t first, size_t last) {
+    for (size_t w = first / 64; w <= last / 64; w++) {
+        uint64_t bits = page_bits(w, first, last);
+        if ((__atomic_load_n(&map[w], __ATOMIC_RELAXED) & bits) != bits) {
+            __atomic_fetch_or(&map[w], bits, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Clear the bits of pages first..last.
+ * @return how many of them were set
+ */
+static size_t pages_clear(uint64_t *map, size_t first, size_t last) {
+    size_t cleared = 0;
+    for (size_t w = first / 64; w <= last / 64; w++) {
+        uint64_t bits = page_bits(w, first, last);
+        if (__atomic_load_n(&map[w], __ATOMIC_RELAXED) & bits) {
+            uint64_t old = __atomic_fetch_and(&map[w], ~bits, __ATOMIC_RELAXED);
+            cleared += (size_t)__builtin_popcountll(old & bits);
+        }
+    }
+    return cleared;
+}
+
+/**
+ * The first page in p..end-1 whose bit is set if set is true, or clear
+ * otherwise. Returns end if there is none.
+ */
+static size_t pages_find(uint64_t *map, size_t p, size_t end, bool set) {
+    while (p < end) {
+        uint64_t word = __atomic_load_n(&map[p / 64], __ATOMIC_RELAXED);
+        word = (set ? word : ~word) & (~UINT64_C(0) << (p % 64));
+        if (word) {
+            p = (p & ~(size_t)63) + (size_t)__builtin_ctzll(word);
+            return p < end ? p : end;
+        }
+        p = (p & ~(size_t)63) + 64;
+    }
+    return end;
+}
+
+/**
+ * Note that pages first..last of a tree are about to be written. Pages
+ * that were purged are counted as reused. Whether that costs a fault is up
+ * to the kernel, MADV_FREE pages it did not take yet come back as they are.
+ */
+static inline void pages_touch(struct buddy_pool *tree, size_t first, size_t last) {
+    if (tree->zero_map) {
+        pages_set(tree->zero_map, first, last);
+    }
+    if (tree->purge_map) {
+        size_t n = pages_clear(tree->purge_map, first, last);
+        if (n) {
+            __atomic_fetch_add(&tree->reused_purged_pages, n, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Push a block onto the front of avail[k] and mark the order as non-empty.
+ */
+static inline void avail_push(struct buddy_pool *pool, struct avail *block, size_t k) {
+    if (pool->zero_map || pool->purge_map) {
+        size_t page = ((uintptr_t)block - (uintptr_t)pool->base) >> PAGE_K;
+        pages_touch(pool, page, page);
+    }
+    block->tag = BLOCK_AVAIL;
+    block->kval = k;
+    block->next = pool->avail[k].next;
+    block->prev = &pool->avail[k];
+    pool->avail[k].next->prev = block;
+    pool->avail[k].next = block;
+    pool->nfree[k]++;
+    pool->avail_bits |= BIT(k);
+}
+
+/**
+ * Unlink a block from avail[block->kval], clearing the order bit when the
+ * list becomes empty.
+ */
+static inline void avail_unlink(struct buddy_pool *pool, struct avail *block) {
+    size_t k = block->kval;
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    if (--pool->nfree[k] == 0) {
+        pool->avail_bits &= ~BIT(k);
+    }
+}
+
+/**
+ * Mark the block at offset off as a free block of order k in the side table.
+ */
+static inline void map_push(struct buddy_pool *pool, uintptr_t off, size_t k) {
+    size_t idx = off >> k;
+    size_t w = idx >> 6;
+    pool->free_map[k][w] |= BIT(idx & 63);
+    if (w < pool->free_hint[k]) {
+        pool->free_hint[k] = w;
+    }
+    pool->nfree[k]++;
+    pool->avail_bits |= BIT(k);
+}
+
+/**
+ * Clear the free bit of the block at offset off if it is set.
+ * @return true if the block was a free block of order k
+ */
+static inline bool map_take(struct buddy_pool *pool, uintptr_t off, size_t k) {
+    size_t idx = off >> k;
+    uint64_t *word = &pool->free_map[k][idx >> 6];
+    if (!(*word & BIT(idx & 63))) {
+        return false;
+    }
+    *word &= ~BIT(idx & 63);
+    if (--pool->nfree[k] == 0) {
+        pool->avail_bits &= ~BIT(k);
+    }
+    return true;
+}
+
+/**
+ * Take the lowest free block of order k out of the side table, the caller
+ * must know that one exists.
+ */
+static inline uintptr_t map_pop(struct buddy_pool *pool, size_t k) {
+    uint64_t *map = pool->free_map[k];
+    size_t w = pool->free_hint[k];
+    while (!map[w]) {
+        w++;
+    }
+    pool->free_hint[k] = w;
+    size_t idx = (w << 6) | (size_t)__builtin_ctzll(map[w]);
+    map[w] &= map[w] - 1;
+    if (--pool->nfree[k] == 0) {
+        pool->avail_bits &= ~BIT(k);
+    }
+    return (uintptr_t)idx << k;
+}
+
+static inline uintptr_t block_off(struct buddy_pool *pool, struct avail *block) {
+    return (uintptr_t)block - (uintptr_t)pool->base;
+}
+
+static inline struct avail *off_block(struct buddy_pool *pool, uintptr_t off) {
+    return (struct avail *)((uintptr_t)pool->base + off);
+}
+
+/**
+ * Number of header bytes in front of every allocation from this pool.
+ */
+static inline size_t pool_hdr(struct buddy_pool *pool) {
+    return (pool->flags & BUDDY_NO_HEADER) ? 0 : sizeof(struct avail);
+}
+
+static inline void *block_ptr(struct buddy_pool *pool, struct avail *block) {
+    return (char *)block + pool_hdr(pool);
+}
+
+static inline struct buddy_pool *tree_of(struct buddy_pool *pool, struct avail *block);
+static inline struct slab *slab_of(struct buddy_pool *tree, void *ptr);
+
+static inline struct avail *ptr_block(struct buddy_pool *pool, void *ptr) {
+    struct avail *hdr = (struct avail *)((char *)ptr - pool_hdr(pool));
+    // Aligned allocations in pools with headers sit further into their
+    // block behind a header that points back at the block. In front of a
+    // slab object is the previous object, whatever the user stored there.
+    if (pool_hdr(pool) && hdr->tag == BLOCK_ALIGNED &&
+        !((pool->flags & BUDDY_SLAB) && slab_of(tree_of(pool, ptr), ptr))) {
+        return hdr->next;
+    }
+    return hdr;
+}
+
+/**
+ * Add a block to the free blocks of order k.
+ */
+static inline void block_push(struct buddy_pool *pool, struct avail *block, size_t k) {
+    if (pool->flags & BUDDY_OUT_OF_LINE) {
+        map_push(pool, block_off(pool, block), k);
+    } else {
+        avail_push(pool, block, k);
+    }
+}
+
+/**
+ * Remove any free block of order k, the caller must know that one exists.
+ */
+static inline struct avail *block_pop(struct buddy_pool *pool, size_t k) {
+    if (pool->flags & BUDDY_OUT_OF_LINE) {
+        return off_block(pool, map_pop(pool, k));
+    }
+    struct avail *block = pool->avail[k].next;
+    avail_unlink(pool, block);
+    return block;
+}
+
+/**
+ * Remove the given block from the free blocks of order k.
+ * @return false if the block is not a free block of order k
+ */
+static inline bool block_take(struct buddy_pool *pool, struct avail *block, size_t k) {
+    if (pool->flags & BUDDY_OUT_OF_LINE) {
+        return map_take(pool, block_off(pool, block), k);
+    }
+    if (block->tag != BLOCK_AVAIL || block->kval != k) {
+        return false;
+    }
+    avail_unlink(pool, block);
+    return true;
+}
+
+/**
+ * Record that a block of order k has been handed out.
+ */
+static inline void block_reserve(struct buddy_pool *pool, struct avail *block, size_t k) {
+    if (pool->flags & BUDDY_OUT_OF_LINE) {
+        pool->order_map[block_off(pool, block) >> SMALLEST_K] = (unsigned char)k;
+        if (pool->flags & BUDDY_NO_HEADER) {
+            return;
+        }
+    }
+    block->tag = BLOCK_RESERVED;
+    block->kval = k;
+}
+
+/**
+ * The order of a reserved block.
+ */
+static inline size_t block_kval(struct buddy_pool *pool, struct avail *block) {
+    if (pool->flags & BUDDY_OUT_OF_LINE) {
+        return pool->order_map[block_off(pool, block) >> SMALLEST_K];
+    }
+    return block->kval;
+}
+
+/**
+ * Coarse monotonic ms clock for purge_decay_ms. It wraps after 49 days,
+ * which the unsigned differences taken in decay_block do not mind. 0 means
+ * a block is not waiting to be purged, so it is skipped.
+ */
+static inline uint32_t decay_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint32_t ms = (uint32_t)((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+    return ms ? ms : 1;
+}
+
+/**
+ * The free_since slot of a block of order purge_order or up.
+ */
+static inline uint32_t *decay_slot(struct buddy_pool *pool, struct avail *block) {
+    return &pool->free_since[block_off(pool, block) >> pool->purge_order];
+}
+
+/**
+ * When the free block of order k became free, 0 if it is not waiting.
+ */
+static inline uint32_t decay_since(struct buddy_pool *pool, struct avail *block, size_t k) {
+    return pool->free_since && k >= pool->purge_order ? *decay_slot(pool, block) : 0;
+}
+
+/**
+ * A free block of order k split off a block that became free at since
+ * keeps waiting from that point.
+ */
+static inline void decay_inherit(struct buddy_pool *pool, struct avail *block, size_t k, uint32_t since) {
+    if (pool->free_since && k >= pool->purge_order) {
+        *decay_slot(pool, block) = since;
+    }
+}
+
+/**
+ * Find a free block of at least order k and split it down to order k.
+ * @return the reserved block or NULL if the pool has no room
+ */
+static struct avail *pool_alloc(struct buddy_pool *pool, size_t k) {
+    // First non-empty order >= k, bits above kval_m are never set
+    uint64_t usable = pool->avail_bits & ~(BIT(k) - 1);
+    if (!usable) {
+        return NULL;
+    }
+    size_t i = (size_t)__builtin_ctzll(usable);
+    struct avail *block = block_pop(pool, i);
+    uint32_t since = decay_since(pool, block, i);
+
+    // Split blocks until we get the correct size, keeping the lower half
+    while (i > k) {
+        i--;
+        struct avail *half = (struct avail *)((char *)block + ((size_t)1 << i));
+        block_push(pool, half, i);
+        decay_inherit(pool, half, i, since);
+    }
+
+    block_reserve(pool, block, k);
+    return block;
+}
+
+/**
+ * Reserve up to n blocks of order k. Free blocks of order k are used up
+ * first, after that each source block is split only once: the first m of
+ * its order k descendants are handed out and the rest of it goes back to
+ * the free lists as at most one block per order.
+ * @return the number of blocks stored in out
+ */
+static size_t pool_alloc_batch(struct buddy_pool *pool, size_t k, struct avail **out, size_t n) {
+    size_t got = 0;
+    while (got < n && pool->nfree[k]) {
+        out[got] = block_pop(pool, k);
+        block_reserve(pool, out[got++], k);
+    }
+
+    while (got < n) {
+        uint64_t usable = pool->avail_bits & ~(BIT(k) - 1);
+        if (!usable) {
+            break;
+        }
+        // Smallest block that covers the rest of the batch, else the largest one
+        size_t need = n - got;
+        size_t want = k + (need > 1 ? 64 - (size_t)__builtin_clzll(need - 1) : 0);
+        uint64_t covers = want < 64 ? usable & ~(BIT(want) - 1) : 0;
+        size_t j = covers ? (size_t)__builtin_ctzll(covers) : 63 - (size_t)__builtin_clzll(usable);
+        char *block = (char *)block_pop(pool, j);
+        uint32_t since = decay_since(pool, (struct avail *)block, j);
+
+        size_t m = (size_t)1 << (j - k);
+        if (need < m) {
+            m = need;
+        }
+        for (size_t i = 0; i < m; i++) {
+            out[got] = (struct avail *)(block + (i << k));
+            block_reserve(pool, out[got++], k);
+        }
+
+        size_t end = (size_t)1 << j;
+        for (size_t pos = m << k; pos < end; pos += pos & -pos) {
+            size_t order = (size_t)__builtin_ctzll(pos);
+            block_push(pool, (struct avail *)(block + pos), order);
+            decay_inherit(pool, (struct avail *)(block + pos), order, since);
+        }
+    }
+    return got;
+}
+
+/**
+ * Give the pages of a free block of order k back to the system, apart from
+ * the one holding its header in pools that write headers into free blocks.
+ * Pages that were purged before and not touched since are skipped, so a
+ * block that keeps merging upwards only purges its new half each time.
+ */
+static void purge_block(struct buddy_pool *pool, struct avail *block, size_t k) {
+    uintptr_t off = block_off(pool, block);
+    size_t p = off >> PAGE_K;
+    size_t end = (off + ((size_t)1 << k)) >> PAGE_K;
+    if (!(pool->flags & BUDDY_OUT_OF_LINE)) {
+        p++;
+    }
+    while ((p = pages_find(pool->purge_map, p, end, false)) < end) {
+        size_t run = pages_find(pool->purge_map, p, end, true);
+        char *addr = (char *)pool->base + (p << PAGE_K);
+        size_t len = (run - p) << PAGE_K;
+        bool lazy = (pool->flags & BUDDY_PURGE_LAZY) && madvise(addr, len, MADV_FREE) == 0;
+        if (!lazy) {
+            madvise(addr, len, MADV_DONTNEED);
+            // Dropped anonymous pages read back as zero
+            if (pool->zero_map) {
+                pages_clear(pool->zero_map, p, run - 1);
+            }
+        }
+        pages_set(pool->purge_map, p, run - 1);
+        __atomic_fetch_add(&pool->purged_bytes, len, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&pool->purges, 1, __ATOMIC_RELAXED);
+        p = run;
+    }
+}
+
+/**
+ * A block of order k >= purge_order has just become free. Purge it now,
+ * or with a decay window note the time and leave it to the decay thread.
+ */
+static inline void purge_freed(struct buddy_pool *pool, struct avail *block, size_t k) {
+    if (pool->free_since) {
+        *decay_slot(pool, block) = decay_now();
+    } else {
+        purge_block(pool, block, k);
+    }
+}
+
+/**
+ * Return a reserved block of order k to the pool, coalescing it with its
+ * free buddies.
+ */
+static void pool_free(struct buddy_pool *pool, struct avail *block, size_t k) {
+    if (pool->flags & BUDDY_OUT_OF_LINE) {
+        pool->order_map[block_off(pool, block) >> SMALLEST_K] = 0;
+    }
+
+    while (k < pool->kval_m) {
+        struct avail *buddy = off_block(pool, block_off(pool, block) ^ ((uintptr_t)1 << k));
+        if (!block_take(pool, buddy, k)) {
+            break;
+        }
+        if (block > buddy) {
+            block = buddy;
+        }
+        k++;
+    }
+
+    block_push(pool, block, k);
+    if (pool->purge_order && k >= pool->purge_order) {
+        purge_freed(pool, block, k);
+    }
+}
+
+/**
+ * Promote a reserved block of order k to order new_k in place by taking
+ * the upper buddy at every level in between. This only works when the
+ * block is the lower half all the way up and every one of those buddies is
+ * a whole free block.
+ * @return false and leaves the tree unchanged if the block can not grow
+ */
+static bool pool_grow(struct buddy_pool *pool, struct avail *block, size_t k, size_t new_k) {
+    if (new_k > pool->kval_m || (block_off(pool, block) & (((uintptr_t)1 << new_k) - 1))) {
+        return false;
+    }
+    for (size_t j = k; j < new_k; j++) {
+        struct avail *buddy = (struct avail *)((char *)block + ((size_t)1 << j));
+        if (!block_take(pool, buddy, j)) {
+            // Put back what we took so far
+            while (j-- > k) {
+                block_push(pool, (struct avail *)((char *)block + ((size_t)1 << j)), j);
+            }
+            return false;
+        }
+    }
+    block_reserve(pool, block, new_k);
+    return true;
+}
+
+/**
+ * Cut a reserved block of order k down to order new_k and free the upper
+ * halves. Their buddies are all part of the block we keep, so none of them
+ * can merge.
+ */
+static void pool_shrink(struct buddy_pool *pool, struct avail *block, size_t k, size_t new_k) {
+    block_reserve(pool, block, new_k);
+    while (k > new_k) {
+        k--;
+        struct avail *tail = (struct avail *)((char *)block + ((size_t)1 << k));
+        block_push(pool, tail, k);
+        if (pool->purge_order && k >= pool->purge_order) {
+            purge_freed(pool, tail, k);
+        }
+    }
+}
+
+static void shared_lock(struct buddy_pool *pool);
+static void shared_unlock(struct buddy_pool *pool);
+
+static inline void pool_lock(struct buddy_pool *pool) {
+    if (pool->flags & BUDDY_SHARED) {
+        shared_lock(pool);
+    } else if (pool->flags & BUDDY_THREAD_SAFE) {
+        pthread_mutex_lock(&pool->lock);
+    }
+}
+
+static inline void pool_unlock(struct buddy_pool *pool) {
+    if (pool->flags & BUDDY_SHARED) {
+        shared_unlock(pool);
+    } else if (pool->flags & BUDDY_THREAD_SAFE) {
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// The region index is an open addressing table of REGION_INDEX bytes
+// behind the region array. Each entry is the slot of a region plus one,
+// filed under the hash of base >> kval_m, 0 for never used or REGION_GONE
+// for a region that was unmapped. It stays at most half full because a
+// region takes up two entries at most.
+#define REGION_INDEX_K 8
+#define REGION_INDEX (1 << REGION_INDEX_K)
+#define REGION_GONE 0xff
+_Static_assert(4 * BUDDY_REGIONS_MAX <= REGION_INDEX, "the region index is too small");
+_Static_assert(BUDDY_REGIONS_MAX < REGION_GONE, "region slots do not fit an index entry");
+
+static inline size_t region_hash(uintptr_t key) {
+    return (size_t)((key * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - REGION_INDEX_K));
+}
+
+/**
+ * The extra region holding addr or NULL. Regions are only added and
+ * released while nobody holds a pointer into them, so a lookup for a live
+ * pointer never races with a change to its own region. Entries of other
+ * regions are only ever turned into tombstones or reused, never emptied,
+ * so the probe sequence of a live region stays intact without the lock.
+ */
+static inline struct buddy_pool *region_of(struct buddy_pool *pool, const void *addr) {
+    size_t h = region_hash((uintptr_t)addr >> pool->kval_m);
+    for (size_t i = 0; i < REGION_INDEX; i++, h = (h + 1) & (REGION_INDEX - 1)) {
+        unsigned char slot = __atomic_load_n(&pool->region_index[h], __ATOMIC_ACQUIRE);
+        if (!slot) {
+            break;
+        }
+        if (slot == REGION_GONE) {
+            continue;
+        }
+        struct buddy_pool *r = &pool->region[slot - 1];
+        uintptr_t base = (uintptr_t)__atomic_load_n(&r->base, __ATOMIC_RELAXED);
+        if ((uintptr_t)addr - base < __atomic_load_n(&r->numbytes, __ATOMIC_RELAXED)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * File the region in slot under every key its mapping at base touches.
+ * A region is aligned to its size up to 2^BASE_ALIGN_K bytes, beyond that
+ * it may straddle two keys. The region lock must be held.
+ */
+static void region_index_add(struct buddy_pool *pool, size_t slot, const void *base) {
+    uintptr_t first = (uintptr_t)base >> pool->kval_m;
+    uintptr_t last = ((uintptr_t)base + ((uintptr_t)1 << pool->kval_m) - 1) >> pool->kval_m;
+    for (uintptr_t key = first; key <= last; key++) {
+        size_t h = region_hash(key);
+        while (pool->region_index[h] && pool->region_index[h] != REGION_GONE) {
+            h = (h + 1) & (REGION_INDEX - 1);
+        }
+        __atomic_store_n(&pool->region_index[h], (unsigned char)(slot + 1), __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Turn the entries of the region in slot into tombstones. The region lock
+ * must be held.
+ */
+static void region_index_remove(struct buddy_pool *pool, size_t slot) {
+    for (size_t h = 0; h < REGION_INDEX; h++) {
+        if (pool->region_index[h] == slot + 1) {
+            __atomic_store_n(&pool->region_index[h], REGION_GONE, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/**
+ * Bytes of the mapping that holds the region array and the region index.
+ */
+static inline size_t region_table_bytes(struct buddy_pool *pool) {
+    return pool->max_regions * sizeof(struct buddy_pool) + REGION_INDEX;
+}
+
+static inline bool is_region(struct buddy_pool *pool, struct buddy_pool *tree) {
+    return pool->max_regions && (uintptr_t)tree - (uintptr_t)pool->region <
+                                    pool->max_regions * sizeof(struct buddy_pool);
+}
+
+/**
+ * The tree that owns a block: the pool itself, one of its arenas or one of
+ * the regions it added.
+ */
+static inline struct buddy_pool *tree_of(struct buddy_pool *pool, struct avail *block) {
+    if (pool->nregions && (uintptr_t)block - (uintptr_t)pool->base >= pool->numbytes) {
+        return region_of(pool, block);
+    }
+    if (!pool->narenas) {
+        return pool;
+    }
+    return &pool->arena[block_off(pool, block) >> pool->arena_k];
+}
+
+/**
+ * Called for every block of order k before it is handed to anyone who may
+ * write to it.
+ */
+static inline void block_handout(struct buddy_pool *pool, struct avail *block, size_t k) {
+    struct buddy_pool *tree = tree_of(pool, block);
+    if (tree->zero_map || tree->purge_map) {
+        uintptr_t off = block_off(tree, block);
+        pages_touch(tree, off >> PAGE_K, (off + ((size_t)1 << k) - 1) >> PAGE_K);
+    }
+}
+
+/**
+ * Zero the len bytes at ptr, which must lie in one block of the tree,
+ * skipping the pages that have not been written since they were mapped.
+ */
+static void zero_fill(struct buddy_pool *tree, char *ptr, size_t len) {
+    if (!tree->zero_map) {
+        memset(ptr, 0, len);
+        return;
+    }
+    uintptr_t off = (uintptr_t)ptr - (uintptr_t)tree->base;
+    uintptr_t end = off + len;
+    while (off < end) {
+        uintptr_t next = ((off >> PAGE_K) + 1) << PAGE_K;
+        if (next > end) {
+            next = end;
+        }
+        size_t page = off >> PAGE_K;
+        if (__atomic_load_n(&tree->zero_map[page / 64], __ATOMIC_RELAXED) & BIT(page % 64)) {
+            memset((char *)tree->base + off, 0, next - off);
+        }
+        off = next;
+    }
+}
+
+/**
+ * The arena of the CPU the calling thread is running on.
+ */
+static inline size_t arena_pick(struct buddy_pool *pool) {
+    int cpu = sched_getcpu();
+    if (cpu < 0) {
+        cpu = (int)((uintptr_t)pthread_self() >> 12);
+    }
+    return (size_t)cpu & (pool->narenas - 1);
+}
+
+static bool region_add(struct buddy_pool *pool, size_t k);
+static void region_release(struct buddy_pool *pool, struct buddy_pool *region);
+
+/**
+ * Reserve up to n blocks of order k, taking the lock of each tree that is
+ * tried once. Pools with arenas start with the calling CPU's arena and only
+ * move on to the others when it runs out. Growable pools then try their
+ * regions and add new ones until they are out of regions too.
+ * @return the number of blocks stored in out
+ */
+static size_t locked_alloc(struct buddy_pool *pool, size_t k, struct avail **out, size_t n) {
+    size_t got = 0;
+    size_t trees = pool->narenas ? pool->narenas : 1;
+    size_t first = pool->narenas ? arena_pick(pool) : 0;
+    for (size_t j = 0; j < trees && got < n; j++) {
+        struct buddy_pool *tree = pool->narenas ? &pool->arena[(first + j) & (trees - 1)] : pool;
+        pool_lock(tree);
+        got += pool_alloc_batch(tree, k, out + got, n - got);
+        pool_unlock(tree);
+    }
+    while (got < n && pool->max_regions) {
+        size_t regions = __atomic_load_n(&pool->nregions, __ATOMIC_ACQUIRE);
+        for (size_t j = 0; j < regions && got < n; j++) {
+            pool_lock(&pool->region[j]);
+            got += pool_alloc_batch(&pool->region[j], k, out + got, n - got);
+            pool_unlock(&pool->region[j]);
+        }
+        if (got < n && !region_add(pool, k)) {
+            break;
+        }
+    }
+    return got;
+}
+
+/**
+ * Unlock a tree after giving blocks back to it. A region that is free
+ * again as a whole may be handed back to the system.
+ */
+static inline void free_unlock(struct buddy_pool *pool, struct buddy_pool *tree) {
+    pool_unlock(tree);
+    if (is_region(pool, tree) && (__atomic_load_n(&tree->avail_bits, __ATOMIC_RELAXED) & BIT(tree->kval_m))) {
+        region_release(pool, tree);
+    }
+}
+
+/**
+ * Return n reserved blocks of order k to the trees that own them, holding
+ * each tree's lock across a run of blocks from the same tree.
+ */
+static void locked_free(struct buddy_pool *pool, struct avail **blocks, size_t n, size_t k) {
+    struct buddy_pool *held = NULL;
+    for (size_t i = 0; i < n; i++) {
+        struct buddy_pool *tree = tree_of(pool, blocks[i]);
+        if (tree != held) {
+            if (held) {
+                free_unlock(pool, held);
+            }
+            pool_lock(tree);
+            held = tree;
+        }
+        pool_free(tree, blocks[i], k);
+    }
+    if (held) {
+        free_unlock(pool, held);
+    }
+}
+
+/**
+ * Blocks of the smallest orders cached by one thread for one pool. Cached
+ * blocks stay reserved as far as the pool is concerned. Each order is a
+ * stack with the oldest blocks at the bottom so flushes return those first.
+ * The cache itself lives in a block of the pool it serves.
+ */
+struct tcache {
+    struct buddy_pool *pool;    /*The pool these blocks belong to*/
+    struct avail *block;        /*The pool block holding this struct*/
+    size_t count[BUDDY_TCACHE_ORDERS_MAX];
+    struct avail *slot[BUDDY_TCACHE_ORDERS_MAX][BUDDY_TCACHE_MAX];
+};
+
+/**
+ * Return the n oldest blocks of cache order i to the pool.
+ */
+static void tcache_flush(struct tcache *tc, size_t i, size_t n) {
+    locked_free(tc->pool, tc->slot[i], n, SMALLEST_K + i);
+    tc->count[i] -= n;
+    memmove(tc->slot[i], tc->slot[i] + n, tc->count[i] * sizeof(struct avail *));
+}
+
+/**
+ * Hand every cached block and the cache itself back to the pool. Runs as
+ * the destructor of pool->tcache_key when a thread exits.
+ */
+static void tcache_destroy(void *arg) {
+    struct tcache *tc = arg;
+    struct buddy_pool *pool = tc->pool;
+    for (size_t i = 0; i < pool->tcache_orders; i++) {
+        tcache_flush(tc, i, tc->count[i]);
+    }
+    struct avail *block = tc->block;
+    locked_free(pool, &block, 1, block_kval(tree_of(pool, block), block));
+}
+
+/**
+ * The calling thread's cache for this pool, created on first use.
+ * @return the cache or NULL if the pool has no room for one
+ */
+static struct tcache *tcache_get(struct buddy_pool *pool) {
+    struct tcache *tc = pthread_getspecific(pool->tcache_key);
+    if (tc) {
+        return tc;
+    }
+
+    struct avail *block;
+    if (!locked_alloc(pool, hdr_btok(sizeof(*tc), pool_hdr(pool)), &block, 1)) {
+        return NULL;
+    }
+    block_handout(pool, block, hdr_btok(sizeof(*tc), pool_hdr(pool)));
+    tc = block_ptr(pool, block);
+    memset(tc->count, 0, sizeof(tc->count));
+    tc->pool = pool;
+    tc->block = block;
+    pthread_setspecific(pool->tcache_key, tc);
+    return tc;
+}
+
+/**
+ * Take a block of order k from the calling thread's cache, refilling it
+ * with a batch from the pool when it is empty.
+ * @return the block or NULL if neither the cache nor the pool has one
+ */
+static struct avail *tcache_alloc(struct tcache *tc, size_t k) {
+    size_t i = k - SMALLEST_K;
+    if (tc->count[i] == 0) {
+        size_t n = locked_alloc(tc->pool, k, tc->slot[i], BUDDY_TCACHE_BATCH);
+        if (n == 0) {
+            return NULL;
+        }
+        // Hand out the lowest addresses first
+        for (size_t j = 0; j < n / 2; j++) {
+            struct avail *tmp = tc->slot[i][j];
+            tc->slot[i][j] = tc->slot[i][n - 1 - j];
+            tc->slot[i][n - 1 - j] = tmp;
+        }
+        tc->count[i] = n;
+    }
+    return tc->slot[i][--tc->count[i]];
+}
+
+/**
+ * Put a reserved block of order k into the calling thread's cache, flushing
+ * a batch to the pool when the cache is full.
+ */
+static void tcache_free(struct tcache *tc, struct avail *block, size_t k) {
+    size_t i = k - SMALLEST_K;
+    if (tc->count[i] == BUDDY_TCACHE_MAX) {
+        tcache_flush(tc, i, BUDDY_TCACHE_BATCH);
+    }
+    tc->slot[i][tc->count[i]++] = block;
+}
+
+static inline bool tcache_order(struct buddy_pool *pool, size_t k) {
+    return k < SMALLEST_K + pool->tcache_orders;
+}
+
+/*
+ * BUDDY_SLAB. A slab is a reserved block of order BUDDY_SLAB_K marked with
+ * BLOCK_SLAB in its header, or ORDER_SLAB in the order map, with a struct
+ * slab right after the header. Any block smaller than a slab lies inside a
+ * single BUDDY_SLAB_K aligned window that starts with a block header, so
+ * rounding a pointer down to that window tells whether it is a slab object.
+ */
+#define ORDER_SLAB  0x80
+#define SLAB_OBJS   512
+
+static const unsigned short slab_sizes[BUDDY_SLAB_CLASSES] = { 8, 16, 24, 32, 48 };
+
+struct slab {
+    struct slab *next;          /*Next slab of this class with free objects*/
+    struct slab *prev;          /*Previous slab of this class with free objects*/
+    unsigned short cls;         /*Size class index*/
+    unsigned short nobj;        /*Number of objects in this slab*/
+    unsigned short nfree;       /*Number of free objects*/
+    uint64_t map[SLAB_OBJS / 64]; /*Bit i is set when object i is free*/
+    char objects[];             /*The objects, 8 byte aligned*/
+};
+
+static inline size_t slab_class(size_t size) {
+    size_t c = 0;
+    while (slab_sizes[c] < size) {
+        c++;
+    }
+    return c;
+}
+
+/**
+ * The slab holding ptr in this tree or NULL if ptr is a regular block.
+ */
+static inline struct slab *slab_of(struct buddy_pool *tree, void *ptr) {
+    uintptr_t off = (uintptr_t)ptr - (uintptr_t)tree->base;
+    // Objects come after the slab header, a pointer right at the start of
+    // the window is an aligned allocation that may have user data there
+    if (!(off & (((uintptr_t)1 << BUDDY_SLAB_K) - 1))) {
+        return NULL;
+    }
+    off &= ~(((uintptr_t)1 << BUDDY_SLAB_K) - 1);
+    struct avail *block = off_block(tree, off);
+    if (tree->flags & BUDDY_OUT_OF_LINE) {
+        if (tree->order_map[off >> SMALLEST_K] != (ORDER_SLAB | BUDDY_SLAB_K)) {
+            return NULL;
+        }
+    } else if (block->tag != BLOCK_SLAB) {
+        return NULL;
+    }
+    return block_ptr(tree, block);
+}
+
+static inline void slab_link(struct buddy_pool *tree, struct slab *slab) {
+    slab->prev = NULL;
+    slab->next = tree->slab_partial[slab->cls];
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    tree->slab_partial[slab->cls] = slab;
+}
+
+static inline void slab_unlink(struct buddy_pool *tree, struct slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        tree->slab_partial[slab->cls] = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * Carve a new slab for class c out of the tree, the tree lock must be held.
+ */
+static struct slab *slab_new(struct buddy_pool *tree, size_t c) {
+    struct avail *block = pool_alloc(tree, BUDDY_SLAB_K);
+    if (!block) {
+        return NULL;
+    }
+    block_handout(tree, block, BUDDY_SLAB_K);
+    if (tree->flags & BUDDY_OUT_OF_LINE) {
+        tree->order_map[block_off(tree, block) >> SMALLEST_K] = ORDER_SLAB | BUDDY_SLAB_K;
+    }
+    if (!(tree->flags & BUDDY_NO_HEADER)) {
+        block->tag = BLOCK_SLAB;
+    }
+
+    struct slab *slab = block_ptr(tree, block);
+    size_t room = ((size_t)1 << BUDDY_SLAB_K) - pool_hdr(tree) - sizeof(struct slab);
+    size_t nobj = room / slab_sizes[c];
+    slab->cls = (unsigned short)c;
+    slab->nobj = (unsigned short)(nobj < SLAB_OBJS ? nobj : SLAB_OBJS);
+    slab->nfree = slab->nobj;
+    memset(slab->map, 0, sizeof(slab->map));
+    for (size_t i = 0; i < slab->nobj; i++) {
+        slab->map[i / 64] |= BIT(i % 64);
+    }
+    slab_link(tree, slab);
+    return slab;
+}
+
+/**
+ * Allocate an object of class c from the tree, the tree lock must be held.
+ */
+static void *slab_alloc(struct buddy_pool *tree, size_t c) {
+    struct slab *slab = tree->slab_partial[c];
+    if (!slab && !(slab = slab_new(tree, c))) {
+        return NULL;
+    }
+    size_t w = 0;
+    while (!slab->map[w]) {
+        w++;
+    }
+    size_t i = (w << 6) | (size_t)__builtin_ctzll(slab->map[w]);
+    slab->map[w] &= slab->map[w] - 1;
+    if (--slab->nfree == 0) {
+        slab_unlink(tree, slab);
+    }
+    return slab->objects + i * slab_sizes[c];
+}
+
+/**
+ * Free an object of the given slab, handing the slab back to the tree once
+ * it is empty. The last slab with room in its class stays cached, except
+ * in a region. The tree lock must be held.
+ */
+static void slab_free(struct buddy_pool *pool, struct buddy_pool *tree, struct slab *slab, void *ptr) {
+    size_t i = (size_t)((char *)ptr - slab->objects) / slab_sizes[slab->cls];
+    slab->map[i / 64] |= BIT(i % 64);
+    if (slab->nfree++ == 0) {
+        slab_link(tree, slab);
+    }
+    // A cached slab would keep its region from ever being released
+    if (slab->nfree == slab->nobj && (slab->next || slab->prev || is_region(pool, tree))) {
+        slab_unlink(tree, slab);
+        struct avail *block = ptr_block(tree, slab);
+        if (!(tree->flags & BUDDY_NO_HEADER)) {
+            block->tag = BLOCK_RESERVED;
+        }
+        pool_free(tree, block, BUDDY_SLAB_K);
+    }
+}
+
+/**
+ * Allocate up to n small objects, starting with the calling CPU's arena.
+ * @return the number of objects stored in out
+ */
+static size_t locked_slab_alloc(struct buddy_pool *pool, size_t size, void **out, size_t n) {
+    size_t c = slab_class(size);
+    size_t got = 0;
+    size_t trees = pool->narenas ? pool->narenas : 1;
+    size_t first = pool->narenas ? arena_pick(pool) : 0;
+    for (size_t j = 0; j < trees && got < n; j++) {
+        struct buddy_pool *tree = pool->narenas ? &pool->arena[(first + j) & (trees - 1)] : pool;
+        pool_lock(tree);
+        while (got < n && (out[got] = slab_alloc(tree, c))) {
+            got++;
+        }
+        pool_unlock(tree);
+    }
+    while (got < n && pool->max_regions) {
+        size_t regions = __atomic_load_n(&pool->nregions, __ATOMIC_ACQUIRE);
+        for (size_t j = 0; j < regions && got < n; j++) {
+            pool_lock(&pool->region[j]);
+            while (got < n && (out[got] = slab_alloc(&pool->region[j], c))) {
+                got++;
+            }
+            pool_unlock(&pool->region[j]);
+        }
+        if (got < n && !region_add(pool, BUDDY_SLAB_K)) {
+            break;
+        }
+    }
+    return got;
+}
+
+/*
+ * BUDDY_LOCK_FREE stacks. A head holds the slot of the top block plus one
+ * (0 is an empty stack) in the low LF_IDX_BITS and a counter that changes
+ * on every update in the rest, so a stale head can never be swapped back in.
+ */
+#define LF_IDX_BITS 42
+#define LF_IDX_MASK ((UINT64_C(1) << LF_IDX_BITS) - 1)
+#define LF_TICK     (UINT64_C(1) << LF_IDX_BITS)
+_Static_assert(MAX_K - 1 - SMALLEST_K < LF_IDX_BITS, "LF_IDX_BITS cannot address every slot");
+
+/* The tag and kval of a header, updated together with one compare and swap */
+typedef uint32_t __attribute__((may_alias)) lf_word_t;
+_Static_assert(sizeof(lf_word_t) == 2 * sizeof(unsigned short), "tag and kval must share a word");
+
+static inline uint32_t lf_word(unsigned short tag, size_t k) {
+    struct avail hdr;
+    hdr.tag = tag;
+    hdr.kval = (unsigned short)k;
+    uint32_t word;
+    memcpy(&word, &hdr, sizeof(word));
+    return word;
+}
+
+static inline void lf_set(struct avail *block, unsigned short tag, size_t k) {
+    __atomic_store_n((lf_word_t *)&block->tag, lf_word(tag, k), __ATOMIC_RELEASE);
+}
+
+static inline bool lf_cas(struct avail *block, unsigned short from, unsigned short to, size_t k) {
+    uint32_t expect = lf_word(from, k);
+    return __atomic_compare_exchange_n((lf_word_t *)&block->tag, &expect, lf_word(to, k), false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline uint64_t lf_idx(struct buddy_pool *pool, struct avail *block) {
+    return block ? (block_off(pool, block) >> SMALLEST_K) + 1 : 0;
+}
+
+static inline struct avail *lf_block(struct buddy_pool *pool, uint64_t head) {
+    uint64_t idx = head & LF_IDX_MASK;
+    return idx ? off_block(pool, (uintptr_t)(idx - 1) << SMALLEST_K) : NULL;
+}
+
+/**
+ * Push a block onto stack k, the caller has already set its tag.
+ */
+static void lf_push(struct buddy_pool *pool, struct avail *block, size_t k) {
+    uint64_t head = __atomic_load_n(&pool->lf_head[k], __ATOMIC_ACQUIRE);
+    uint64_t next;
+    do {
+        __atomic_store_n(&block->next, lf_block(pool, head), __ATOMIC_RELAXED);
+        next = lf_idx(pool, block) | ((head & ~LF_IDX_MASK) + LF_TICK);
+    } while (!__atomic_compare_exchange_n(&pool->lf_head[k], &head, next, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Unlink the top block of stack k whatever its tag is.
+ * @return the block or NULL if the stack is empty
+ */
+static struct avail *lf_pop_raw(struct buddy_pool *pool, size_t k) {
+    uint64_t head = __atomic_load_n(&pool->lf_head[k], __ATOMIC_ACQUIRE);
+    uint64_t next;
+    struct avail *block;
+    do {
+        block = lf_block(pool, head);
+        if (!block) {
+            return NULL;
+        }
+        // The block may be reused under us, the tick makes the swap fail then
+        next = lf_idx(pool, __atomic_load_n(&block->next, __ATOMIC_RELAXED)) |
+               ((head & ~LF_IDX_MASK) + LF_TICK);
+    } while (!__atomic_compare_exchange_n(&pool->lf_head[k], &head, next, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return block;
+}
+
+static void lf_free(struct buddy_pool *pool, struct avail *block, size_t k);
+
+/**
+ * Finish the merge of a BLOCK_PENDING block of order k that has just been
+ * popped. Its buddy was parked by the free that claimed it.
+ */
+static void lf_merge(struct buddy_pool *pool, struct avail *block, size_t k) {
+    struct avail *buddy = off_block(pool, block_off(pool, block) ^ ((uintptr_t)1 << k));
+    lf_free(pool, block < buddy ? block : buddy, k + 1);
+}
+
+/**
+ * Reserve a block of order k from stack k, finishing any pending merges
+ * that come off the stack on the way.
+ * @return the block or NULL if the stack is empty
+ */
+static struct avail *lf_pop(struct buddy_pool *pool, size_t k) {
+    struct avail *block;
+    while ((block = lf_pop_raw(pool, k))) {
+        if (lf_cas(block, BLOCK_AVAIL, BLOCK_RESERVED, k)) {
+            return block;
+        }
+        lf_merge(pool, block, k);
+    }
+    return NULL;
+}
+
+/**
+ * Return a block of order k that the caller owns. If its buddy is free the
+ * buddy is claimed and the merged block is left for whoever pops the buddy,
+ * otherwise the block goes on stack k.
+ */
+static void lf_free(struct buddy_pool *pool, struct avail *block, size_t k) {
+    lf_set(block, BLOCK_RESERVED, k);
+    if (k < pool->kval_m) {
+        struct avail *buddy = off_block(pool, block_off(pool, block) ^ ((uintptr_t)1 << k));
+        if (lf_cas(buddy, BLOCK_AVAIL, BLOCK_PENDING, k)) {
+            return;
+        }
+    }
+    lf_set(block, BLOCK_AVAIL, k);
+    lf_push(pool, block, k);
+}
+
+/**
+ * Empty every stack from the smallest order up, finishing pending merges
+ * and merging free buddies that were pushed side by side because they were
+ * freed at the same time. Only one thread drains at a time, the others
+ * return straight away. Blocks taken off a stack are marked BLOCK_UNUSED
+ * while they sit on the drainer's private list.
+ */
+static void lf_drain(struct buddy_pool *pool) {
+    if (__atomic_exchange_n(&pool->lf_draining, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    for (size_t k = SMALLEST_K; k < pool->kval_m; k++) {
+        struct avail *list = NULL;
+        struct avail *block;
+        while ((block = lf_pop_raw(pool, k))) {
+            if (!lf_cas(block, BLOCK_AVAIL, BLOCK_UNUSED, k)) {
+                lf_merge(pool, block, k);
+                continue;
+            }
+            block->prev = NULL;
+            block->next = list;
+            if (list) {
+                list->prev = block;
+            }
+            list = block;
+        }
+        while ((block = list)) {
+            list = block->next;
+            if (list) {
+                list->prev = NULL;
+            }
+            struct avail *buddy = off_block(pool, block_off(pool, block) ^ ((uintptr_t)1 << k));
+            if (__atomic_load_n((lf_word_t *)&buddy->tag, __ATOMIC_RELAXED) == lf_word(BLOCK_UNUSED, k)) {
+                // Both halves are on our list
+                if (buddy->prev) {
+                    buddy->prev->next = buddy->next;
+                } else {
+                    list = buddy->next;
+                }
+                if (buddy->next) {
+                    buddy->next->prev = buddy->prev;
+                }
+                lf_free(pool, block < buddy ? block : buddy, k + 1);
+            } else {
+                lf_free(pool, block, k);
+            }
+        }
+    }
+    __atomic_store_n(&pool->lf_draining, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Lock free counterpart of pool_alloc.
+ */
+static struct avail *lf_alloc(struct buddy_pool *pool, size_t k) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        for (size_t i = k; i <= pool->kval_m; i++) {
+            if (!(__atomic_load_n(&pool->lf_head[i], __ATOMIC_RELAXED) & LF_IDX_MASK)) {
+                continue;
+            }
+            struct avail *block = lf_pop(pool, i);
+            if (!block) {
+                continue;
+            }
+            // Nobody else can reach the upper halves until they are pushed
+            while (i > k) {
+                i--;
+                struct avail *upper = (struct avail *)((char *)block + ((size_t)1 << i));
+                lf_set(upper, BLOCK_AVAIL, i);
+                lf_push(pool, upper, i);
+            }
+            lf_set(block, BLOCK_RESERVED, k);
+            return block;
+        }
+        lf_drain(pool);
+    }
+    return NULL;
+}
+
+/**
+ * Fault in the len bytes of a fresh mapping at addr now instead of on
+ * first use. Kernels before 5.14 do not know MADV_POPULATE_WRITE, there we
+ * write to every page. Writing zero leaves fresh pages what they were.
+ */
+static void prefault(void *addr, size_t len) {
+    if (madvise(addr, len, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+    for (volatile char *p = addr; p < (char *)addr + len; p += (size_t)1 << PAGE_K) {
+        *p = 0;
+    }
+}
+
+/**
+ * One prefault thread: slices first, first + stride, ... of a mapping cut
+ * into slices of slice bytes, the last one taking the remainder.
+ */
+struct prefault_job {
+    char *addr;
+    size_t len;
+    size_t slice;
+    size_t slices;
+    size_t first;
+    size_t stride;
+    size_t narenas;
+    const cpu_set_t *cpus;
+};
+
+/**
+ * The CPU that faults slice s in: one that arena_pick maps to arena s if
+ * the mapping is split into arenas, else the s-th CPU we may run on,
+ * counting around. With more arenas than CPUs some arenas have no CPU of
+ * their own, they get the s-th CPU as well rather than leaving the thread
+ * on the CPU of its previous slice.
+ * @return -1 if there is no such CPU
+ */
+static int prefault_cpu(const cpu_set_t *cpus, size_t s, size_t narenas) {
+    int count = CPU_COUNT(cpus);
+    if (count == 0) {
+        return -1;
+    }
+    for (int cpu = 0; narenas && cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, cpus) && ((size_t)cpu & (narenas - 1)) == s) {
+            return cpu;
+        }
+    }
+    size_t nth = s % (size_t)count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, cpus) && nth-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+static void *prefault_main(void *arg) {
+    struct prefault_job *job = arg;
+    for (size_t s = job->first; s < job->slices; s += job->stride) {
+        int cpu = prefault_cpu(job->cpus, s, job->narenas);
+        if (cpu >= 0) {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+        }
+        size_t off = s * job->slice;
+        prefault(job->addr + off, s == job->slices - 1 ? job->len - off : job->slice);
+    }
+    return NULL;
+}
+
+/**
+ * Prefault a mapping with up to threads threads. A mapping split into
+ * narenas arenas is cut along the arenas, anything else into one slice
+ * per thread. Slices are kept whole multiples of 2^BUDDY_HUGE_K bytes so
+ * no transparent huge page is shared by two threads.
+ */
+static void prefault_parallel(void *addr, size_t len, size_t threads, size_t narenas) {
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) {
+        CPU_ZERO(&cpus);
+    }
+    if (threads == BUDDY_INIT_THREADS_PER_CPU) {
+        threads = CPU_COUNT(&cpus) > 0 ? (size_t)CPU_COUNT(&cpus) : 1;
+    }
+    if (threads > BUDDY_INIT_THREADS_MAX) {
+        threads = BUDDY_INIT_THREADS_MAX;
+    }
+    size_t slices = narenas ? narenas : threads;
+    size_t slice = threads > 1 ? (len / slices) & ~(((size_t)1 << BUDDY_HUGE_K) - 1) : 0;
+    if (slice == 0) {
+        prefault(addr, len);
+        return;
+    }
+    if (threads > slices) {
+        threads = slices;
+    }
+
+    pthread_t tid[BUDDY_INIT_THREADS_MAX];
+    struct prefault_job jobs[BUDDY_INIT_THREADS_MAX];
+    bool started[BUDDY_INIT_THREADS_MAX];
+    for (size_t t = 0; t < threads; t++) {
+        jobs[t] = (struct prefault_job){ addr, len, slice, slices, t, threads, narenas, &cpus };
+        started[t] = pthread_create(&tid[t], NULL, prefault_main, &jobs[t]) == 0;
+        if (!started[t]) {
+            prefault_main(&jobs[t]);
+        }
+    }
+    for (size_t t = 0; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(tid[t], NULL);
+        }
+    }
+}
+
+/**
+ * Prefault or lock a fresh mapping as the flags ask, with threads threads.
+ * The pages are faulted in before mlock so that it only has to pin them,
+ * mlock would fault them in from this thread alone. BUDDY_MLOCK is cleared
+ * from *flags if the pages can not be locked.
+ */
+static void map_populate(void *addr, size_t len, unsigned int *flags, size_t threads, size_t narenas) {
+    if (*flags & (BUDDY_PREFAULT | BUDDY_MLOCK)) {
+        prefault_parallel(addr, len, threads, narenas);
+    }
+    if ((*flags & BUDDY_MLOCK) && mlock(addr, len) != 0) {
+        *flags &= ~BUDDY_MLOCK;
+    }
+}
+
+/**
+ * Size of the side table used by BUDDY_OUT_OF_LINE: one bitmap per order
+ * SMALLEST_K..kval_m followed by one byte per SMALLEST_K slot for the order
+ * map.
+ */
+static size_t meta_size(size_t kval_m) {
+    size_t bytes = 0;
+    for (size_t k = SMALLEST_K; k <= kval_m; k++) {
+        size_t bits = (size_t)1 << (kval_m - k);
+        bytes += (bits + 63) / 64 * sizeof(uint64_t);
+    }
+    return bytes + ((size_t)1 << (kval_m - SMALLEST_K));
+}
+
+/**
+ * Point the bitmaps and the order map of a pool into the meta_size bytes
+ * at map.
+ */
+static void meta_layout(struct buddy_pool *pool, void *map) {
+    uint64_t *word = map;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        size_t bits = (size_t)1 << (pool->kval_m - k);
+        pool->free_map[k] = word;
+        word += (bits + 63) / 64;
+    }
+    pool->order_map = (unsigned char *)word;
+}
+
+/**
+ * Map the side table of a pool. The mapping is only faulted in where the
+ * pool is actually used, unless it is prefaulted.
+ */
+static bool meta_init(struct buddy_pool *pool) {
+    pool->meta_bytes = meta_size(pool->kval_m);
+    pool->meta = mmap(NULL, pool->meta_bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool->meta == MAP_FAILED) {
+        pool->meta = NULL;
+        return false;
+    }
+
+    // A side table that could not be locked leaves the pool only partly
+    // pinned, which counts as not locked, like a failed mlock of the pool
+    unsigned int flags = pool->flags;
+    map_populate(pool->meta, pool->meta_bytes, &flags, pool->init_threads, 0);
+    pool->flags &= flags | ~BUDDY_MLOCK;
+    meta_layout(pool, pool->meta);
+    return true;
+}
+
+/**
+ * Reset the avail sentinels, every list starts out empty.
+ */
+static void avail_init(struct buddy_pool *pool) {
+    for (size_t i = 0; i < MAX_K; i++) {
+        pool->avail[i].tag = BLOCK_UNUSED;
+        pool->avail[i].kval = i;
+        pool->avail[i].next = &pool->avail[i];
+        pool->avail[i].prev = &pool->avail[i];
+    }
+}
+
+/**
+ * Point a tree at the 2^k bytes at base with all of them free. The lock is
+ * left alone so region slots can be reused while other threads look at them.
+ * @return false if the side table could not be mapped
+ */
+static bool tree_reset(struct buddy_pool *tree, void *base, size_t k, unsigned int flags) {
+    tree->kval_m = k;
+    tree->base = base;
+    tree->flags = flags;
+    tree->avail_bits = 0;
+    memset(tree->nfree, 0, sizeof(tree->nfree));
+    memset(tree->free_hint, 0, sizeof(tree->free_hint));
+    memset(tree->slab_partial, 0, sizeof(tree->slab_partial));
+    avail_init(tree);
+    if ((flags & BUDDY_OUT_OF_LINE) && !meta_init(tree)) {
+        return false;
+    }
+
+    // Set up initial free block, sentinel stays BLOCK_UNUSED
+    if (flags & BUDDY_LOCK_FREE) {
+        lf_set((struct avail *)base, BLOCK_AVAIL, k);
+        lf_push(tree, (struct avail *)base, k);
+    } else {
+        block_push(tree, (struct avail *)base, k);
+    }
+    __atomic_store_n(&tree->numbytes, (size_t)1 << k, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Set up a single buddy tree managing the 2^k bytes at base.
+ */
+static void tree_init(struct buddy_pool *tree, void *base, size_t k, unsigned int flags) {
+    if (flags & BUDDY_THREAD_SAFE) {
+        pthread_mutex_init(&tree->lock, NULL);
+    }
+    if (!tree_reset(tree, base, k, flags)) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Release what tree_init set up, apart from the managed memory itself.
+ */
+static void tree_destroy(struct buddy_pool *tree) {
+    if (tree->meta) {
+        munmap(tree->meta, tree->meta_bytes);
+        tree->meta = NULL;
+    }
+    if (tree->flags & BUDDY_THREAD_SAFE) {
+        pthread_mutex_destroy(&tree->lock);
+    }
+}
+
+/**
+ * Size of a page bitmap for a 2^k byte tree.
+ */
+static size_t page_map_bytes(size_t k) {
+    return ((((size_t)1 << k) >> PAGE_K) + 7) / 8;
+}
+
+/**
+ * Size of the free_since slots of a 2^k byte tree.
+ */
+static size_t decay_slots_bytes(size_t k, size_t purge_order) {
+    size_t slots = k > purge_order ? (size_t)1 << (k - purge_order) : 1;
+    return slots * sizeof(uint32_t);
+}
+
+/**
+ * Map the page bitmaps a tree of 2^k bytes needs for the zero tracking
+ * and purging it was set up with, plus the free_since slots if purging is
+ * delayed. Zero bits mean zero pages that were never purged, which is what
+ * a fresh mapping holds.
+ * @return false if a mapping failed
+ */
+static bool page_maps_init(struct buddy_pool *tree, size_t k, unsigned int flags) {
+    if (flags & BUDDY_TRACK_ZERO) {
+        tree->zero_map = mmap(NULL, page_map_bytes(k), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tree->zero_map == MAP_FAILED) {
+            tree->zero_map = NULL;
+            return false;
+        }
+    }
+    if (tree->purge_order) {
+        tree->purge_map = mmap(NULL, page_map_bytes(k), PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tree->purge_map == MAP_FAILED) {
+            tree->purge_map = NULL;
+            return false;
+        }
+    }
+    if (tree->purge_order && tree->purge_decay_ms) {
+        tree->free_since = mmap(NULL, decay_slots_bytes(k, tree->purge_order), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tree->free_since == MAP_FAILED) {
+            tree->free_since = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void page_maps_destroy(struct buddy_pool *tree, size_t k) {
+    if (tree->zero_map) {
+        munmap(tree->zero_map, page_map_bytes(k));
+        tree->zero_map = NULL;
+    }
+    if (tree->purge_map) {
+        munmap(tree->purge_map, page_map_bytes(k));
+        tree->purge_map = NULL;
+    }
+    if (tree->free_since) {
+        munmap(tree->free_since, decay_slots_bytes(k, tree->purge_order));
+        tree->free_since = NULL;
+    }
+}
+
+/* Pools are aligned to their own size up to this order */
+#define BASE_ALIGN_K 30
+
+/**
+ * Map size bytes of normal pages at an address aligned to align. Maps a
+ * larger range and unmaps the slack on both sides.
+ */
+static void *map_aligned(size_t size, size_t align) {
+    char *raw = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    char *base = (char *)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+    if (base > raw) {
+        munmap(raw, (size_t)(base - raw));
+    }
+    if (base + size < raw + size + align) {
+        munmap(base + size, (size_t)(raw + align - base));
+    }
+    return base;
+}
+
+/**
+ * Map 2^k bytes aligned to 2^min(k, BASE_ALIGN_K), so every block is
+ * aligned to its own size in memory and not just relative to the base.
+ * Huge page pools are aligned to at least their page size. The huge page
+ * flags that could not be honoured are cleared from *flags.
+ */
+static void *map_pool(size_t k, unsigned int *flags, size_t huge_k) {
+    size_t size = (size_t)1 << k;
+    size_t align_k = k < BASE_ALIGN_K ? k : BASE_ALIGN_K;
+    if ((*flags & (BUDDY_HUGETLB | BUDDY_THP)) && align_k < huge_k) {
+        align_k = huge_k;
+    }
+    size_t align = (size_t)1 << align_k;
+
+    if ((*flags & BUDDY_HUGETLB) && k >= huge_k) {
+        // Find an aligned hole with normal pages, then put the huge pages
+        // there. A kernel that does not know MAP_FIXED_NOREPLACE takes the
+        // address as a hint and may put them elsewhere
+        char *hole = map_aligned(size, align);
+        if (hole != MAP_FAILED) {
+            munmap(hole, size);
+            char *base = mmap(hole, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_HUGETLB |
+                                  (int)(huge_k << MAP_HUGE_SHIFT),
+                              -1, 0);
+            if (base == hole) {
+                *flags &= ~BUDDY_THP;
+                return base;
+            }
+            if (base != MAP_FAILED) {
+                munmap(base, size);
+            }
+        }
+    }
+    *flags &= ~BUDDY_HUGETLB;
+
+    char *base = map_aligned(size, align);
+    if (base != MAP_FAILED && (*flags & BUDDY_THP) && madvise(base, size, MADV_HUGEPAGE) != 0) {
+        *flags &= ~BUDDY_THP;
+    }
+    return base;
+}
+
+static inline void region_lock(struct buddy_pool *pool) {
+    if (pool->flags & BUDDY_THREAD_SAFE) {
+        pthread_mutex_lock(&pool->region_lock);
+    }
+}
+
+static inline void region_unlock(struct buddy_pool *pool) {
+    if (pool->flags & BUDDY_THREAD_SAFE) {
+        pthread_mutex_unlock(&pool->region_lock);
+    }
+}
+
+/**
+ * Map a new region the size of the pool, reusing the slot of a released
+ * one if there is any. Does nothing if another thread already made room
+ * for a block of order k while we waited for the lock.
+ * @return false if the pool can not grow any further
+ */
+static bool region_add(struct buddy_pool *pool, size_t k) {
+    region_lock(pool);
+    size_t slot = pool->nregions;
+    for (size_t i = 0; i < pool->nregions; i++) {
+        struct buddy_pool *r = &pool->region[i];
+        if (!r->numbytes) {
+            slot = i < slot ? i : slot;
+        } else if (__atomic_load_n(&r->avail_bits, __ATOMIC_RELAXED) & ~(BIT(k) - 1)) {
+            region_unlock(pool);
+            return true;
+        }
+    }
+
+    bool added = false;
+    // Regions only try for the huge pages the pool itself got
+    unsigned int flags = pool->flags;
+    void *base = slot < pool->max_regions ? map_pool(pool->kval_m, &flags, pool->huge_k) : MAP_FAILED;
+    if (base != MAP_FAILED) {
+        map_populate(base, (size_t)1 << pool->kval_m, &flags, pool->init_threads, 0);
+        struct buddy_pool *r = &pool->region[slot];
+        region_index_add(pool, slot, base);
+        if (slot == pool->nregions && (pool->flags & BUDDY_THREAD_SAFE)) {
+            pthread_mutex_init(&r->lock, NULL);
+        }
+        pool_lock(r);
+        r->purge_order = pool->purge_order;
+        r->purge_decay_ms = pool->purge_decay_ms;
+        r->init_threads = pool->init_threads;
+        added = page_maps_init(r, pool->kval_m, flags) &&
+                tree_reset(r, base, pool->kval_m, flags);
+        pool_unlock(r);
+        if (!added) {
+            region_index_remove(pool, slot);
+            page_maps_destroy(r, pool->kval_m);
+            munmap(base, (size_t)1 << pool->kval_m);
+        } else if (slot == pool->nregions) {
+            __atomic_store_n(&pool->nregions, slot + 1, __ATOMIC_RELEASE);
+        }
+    }
+    region_unlock(pool);
+    return added;
+}
+
+/**
+ * Unmap a region and its side tables, the region lock and the lock of the
+ * region itself must be held.
+ * @return the number of bytes given back
+ */
+static size_t region_unmap(struct buddy_pool *pool, struct buddy_pool *r) {
+    size_t bytes = r->numbytes;
+    region_index_remove(pool, (size_t)(r - pool->region));
+    __atomic_store_n(&r->numbytes, 0, __ATOMIC_RELAXED);
+    munmap(r->base, bytes);
+    __atomic_store_n(&r->base, NULL, __ATOMIC_RELAXED);
+    r->avail_bits = 0;
+    memset(r->nfree, 0, sizeof(r->nfree));
+    if (r->meta) {
+        munmap(r->meta, r->meta_bytes);
+        r->meta = NULL;
+    }
+    page_maps_destroy(r, pool->kval_m);
+    return bytes;
+}
+
+static inline bool region_empty(struct buddy_pool *r) {
+    return r->numbytes && (r->avail_bits & BIT(r->kval_m));
+}
+
+/**
+ * Unmap a region that has become completely free, unless it is the only
+ * empty region left. Keeping one spare stops a pool that keeps crossing
+ * the edge of a region from mapping and unmapping it over and over.
+ */
+static void region_release(struct buddy_pool *pool, struct buddy_pool *region) {
+    region_lock(pool);
+    bool spare = false;
+    for (size_t i = 0; i < pool->nregions && !spare; i++) {
+        struct buddy_pool *r = &pool->region[i];
+        spare = r != region && r->numbytes &&
+                (__atomic_load_n(&r->avail_bits, __ATOMIC_RELAXED) & BIT(r->kval_m));
+    }
+    if (spare) {
+        pool_lock(region);
+        if (region_empty(region)) {
+            region_unmap(pool, region);
+        }
+        pool_unlock(region);
+    }
+    region_unlock(pool);
+}
+
+/**
+ * Purge a free block of order k if it has been free for window ms.
+ */
+static void decay_block(struct buddy_pool *tree, struct avail *block, size_t k, uint32_t now,
+                        uint32_t window) {
+    uint32_t *since = decay_slot(tree, block);
+    if (*since && now - *since >= window) {
+        purge_block(tree, block, k);
+        *since = 0;
+    }
+}
+
+/**
+ * Purge every free block of a tree whose decay window has passed. The
+ * caller holds the lock of the tree.
+ */
+static void decay_tree(struct buddy_pool *tree, uint32_t now, uint32_t window) {
+    for (size_t k = tree->purge_order; k <= tree->kval_m; k++) {
+        if (!tree->nfree[k]) {
+            continue;
+        }
+        if (tree->flags & BUDDY_OUT_OF_LINE) {
+            size_t words = ((((size_t)1 << (tree->kval_m - k)) + 63) / 64);
+            for (size_t w = tree->free_hint[k]; w < words; w++) {
+                for (uint64_t bits = tree->free_map[k][w]; bits; bits &= bits - 1) {
+                    uintptr_t off = (uintptr_t)((w << 6) | (size_t)__builtin_ctzll(bits)) << k;
+                    decay_block(tree, off_block(tree, off), k, now, window);
+                }
+            }
+        } else {
+            for (struct avail *b = tree->avail[k].next; b != &tree->avail[k]; b = b->next) {
+                decay_block(tree, b, k, now, window);
+            }
+        }
+    }
+}
+
+/**
+ * One pass of the decay thread over every tree of the pool, taking one
+ * tree lock at a time.
+ */
+static void decay_pass(struct buddy_pool *pool) {
+    uint32_t now = decay_now();
+    uint32_t window = (uint32_t)pool->purge_decay_ms;
+    if (pool->narenas) {
+        for (size_t i = 0; i < pool->narenas; i++) {
+            pool_lock(&pool->arena[i]);
+            decay_tree(&pool->arena[i], now, window);
+            pool_unlock(&pool->arena[i]);
+        }
+    } else {
+        pool_lock(pool);
+        decay_tree(pool, now, window);
+        pool_unlock(pool);
+    }
+    size_t n = __atomic_load_n(&pool->nregions, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < n; i++) {
+        struct buddy_pool *r = &pool->region[i];
+        pool_lock(r);
+        if (r->numbytes) {
+            decay_tree(r, now, window);
+        }
+        pool_unlock(r);
+    }
+}
+
+static void *decay_main(void *arg) {
+    struct buddy_pool *pool = arg;
+    size_t step = pool->purge_decay_ms / BUDDY_DECAY_STEPS;
+    if (step == 0) {
+        step = 1;
+    }
+    pthread_mutex_lock(&pool->decay_lock);
+    while (!pool->decay_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += (time_t)(step / 1000);
+        until.tv_nsec += (long)(step % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&pool->decay_cond, &pool->decay_lock, &until);
+        if (pool->decay_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&pool->decay_lock);
+        decay_pass(pool);
+        pthread_mutex_lock(&pool->decay_lock);
+    }
+    pthread_mutex_unlock(&pool->decay_lock);
+    return NULL;
+}
+
+/**
+ * Start the decay thread once every tree of the pool is set up.
+ */
+static void decay_start(struct buddy_pool *pool) {
+    if (!pool->free_since) {
+        return;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->decay_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&pool->decay_lock, NULL);
+    if (pthread_create(&pool->decay_thread, NULL, decay_main, pool) != 0) {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Stop the decay thread and wait for it, before the trees are torn down.
+ */
+static void decay_join(struct buddy_pool *pool) {
+    if (!pool->free_since) {
+        return;
+    }
+    pthread_mutex_lock(&pool->decay_lock);
+    pool->decay_stop = true;
+    pthread_cond_signal(&pool->decay_cond);
+    pthread_mutex_unlock(&pool->decay_lock);
+    pthread_join(pool->decay_thread, NULL);
+    pthread_cond_destroy(&pool->decay_cond);
+    pthread_mutex_destroy(&pool->decay_lock);
+}
+
+/**
+ * Number of arenas to split a 2^k pool into: a power of two that leaves
+ * every arena at least 2^MIN_K bytes, or 0 for a single tree.
+ */
+static size_t arena_count(size_t want, size_t k) {
+    if (want == BUDDY_ARENAS_PER_CPU) {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        want = cpus > 0 ? (size_t)cpus : 1;
+    }
+    size_t n = 1;
+    while (n < want && ((n << 1) << MIN_K) <= ((size_t)1 << k)) {
+        n <<= 1;
+    }
+    return n > 1 ? n : 0;
+}
+
+/**
+ * Point arena i at its slice of the pool's page bitmaps and decay slots.
+ */
+static void arena_page_maps(struct buddy_pool *pool, size_t i) {
+    struct buddy_pool *arena = &pool->arena[i];
+    size_t word = ((i << pool->arena_k) >> PAGE_K) / 64;
+    arena->zero_map = pool->zero_map ? pool->zero_map + word : NULL;
+    arena->purge_map = pool->purge_map ? pool->purge_map + word : NULL;
+    arena->purge_order = pool->purge_order;
+    arena->free_since =
+        pool->free_since ? pool->free_since + ((i << pool->arena_k) >> pool->purge_order) : NULL;
+}
+
+/**
+ * Finish BUDDY_MLOCK for a new pool whose trees are set up. A pool only
+ * counts as locked if its side tables could be locked too. If one of them
+ * could not be, unlock the rest so a half locked pool does not hold on to
+ * RLIMIT_MEMLOCK, and purge as the options asked for after all. flags are
+ * the flags the pool was mapped with.
+ */
+static void mlock_settle(struct buddy_pool *pool, unsigned int flags, size_t purge_order,
+                         size_t purge_decay_ms) {
+    if (!(flags & BUDDY_MLOCK) || (pool->flags & BUDDY_MLOCK)) {
+        return;
+    }
+    munlock(pool->base, pool->numbytes);
+    size_t ntrees = pool->narenas ? pool->narenas : 1;
+    struct buddy_pool *trees = pool->narenas ? pool->arena : pool;
+    for (size_t i = 0; i < ntrees; i++) {
+        if (trees[i].meta) {
+            munlock(trees[i].meta, trees[i].meta_bytes);
+        }
+        trees[i].flags &= ~BUDDY_MLOCK;
+    }
+
+    // Huge page pools do not purge either way
+    if (flags & BUDDY_HUGETLB) {
+        return;
+    }
+    pool->purge_order = purge_order;
+    pool->purge_decay_ms = purge_decay_ms;
+    if (!page_maps_init(pool, pool->kval_m, flags & ~BUDDY_TRACK_ZERO)) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < pool->narenas; i++) {
+        arena_page_maps(pool, i);
+    }
+}
+
+/**
+ * The order of a pool of size bytes, see buddy_init.
+ */
+static size_t pool_order(size_t size) {
+    if (size == 0) {
+        return DEFAULT_K;
+    }
+    size_t k = MIN_K;
+    size_t actual_size = (size_t)1 << MIN_K;
+    while (actual_size < size) {
+        actual_size <<= 1;
+        k++;
+    }
+    return k;
+}
+
+void buddy_init(struct buddy_pool *pool, size_t size) {
+    buddy_init_opts(pool, size, NULL);
+}
+
+void buddy_init_opts(struct buddy_pool *pool, size_t size, const struct buddy_options *opts) {
+    if (!pool) {
+        return;
+    }
+
+    size_t k = pool_order(size);
+    memset(pool, 0, sizeof(*pool));
+    // BUDDY_SHARED needs the control block only buddy_init_shared sets up
+    unsigned int flags = opts ? opts->flags & ~BUDDY_SHARED : 0;
+    if (flags & BUDDY_LOCK_FREE) {
+        flags = BUDDY_LOCK_FREE;
+        opts = NULL;
+    }
+    if (flags & BUDDY_NO_HEADER) {
+        flags |= BUDDY_OUT_OF_LINE;
+    }
+    if (opts && opts->tcache_orders) {
+        flags |= BUDDY_THREAD_SAFE;
+        pool->tcache_orders = opts->tcache_orders;
+        if (pool->tcache_orders > BUDDY_TCACHE_ORDERS_MAX) {
+            pool->tcache_orders = BUDDY_TCACHE_ORDERS_MAX;
+        }
+        if (pthread_key_create(&pool->tcache_key, tcache_destroy) != 0) {
+            perror("pthread_key_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (opts && opts->arenas) {
+        flags |= BUDDY_THREAD_SAFE;
+        pool->narenas = arena_count(opts->arenas, k);
+    }
+    if (opts) {
+        pool->shrink_slack = opts->shrink_slack;
+        pool->mmap_threshold = opts->mmap_threshold;
+        pool->max_regions = opts->max_regions;
+        if (pool->max_regions > BUDDY_REGIONS_MAX) {
+            pool->max_regions = BUDDY_REGIONS_MAX;
+        }
+        // Purging works on whole pages
+        pool->purge_order = opts->purge_order;
+        if (pool->purge_order && pool->purge_order < PAGE_K) {
+            pool->purge_order = PAGE_K;
+        }
+        // The decay thread shares the trees with the caller
+        if (pool->purge_order && opts->purge_decay_ms) {
+            flags |= BUDDY_THREAD_SAFE;
+            pool->purge_decay_ms = opts->purge_decay_ms;
+            if (pool->purge_decay_ms > UINT32_MAX / 2) {
+                pool->purge_decay_ms = UINT32_MAX / 2;
+            }
+        }
+        // MAP_HUGETLB only knows page sizes from a page up, and a page
+        // bigger than the pool could never be aligned inside it
+        pool->huge_k = opts->huge_page_k;
+        if (pool->huge_k < PAGE_K || pool->huge_k > k) {
+            pool->huge_k = BUDDY_HUGE_K;
+        }
+        pool->init_threads = opts->init_threads;
+    }
+    pthread_mutex_init(&pool->big_lock, NULL);
+    if (pool->max_regions) {
+        pool->region = mmap(NULL, region_table_bytes(pool), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool->region == MAP_FAILED) {
+            perror("mmap failed");
+            exit(EXIT_FAILURE);
+        }
+        pool->region_index = (unsigned char *)(pool->region + pool->max_regions);
+        pthread_mutex_init(&pool->region_lock, NULL);
+    }
+
+    void *base = map_pool(k, &flags, pool->huge_k);
+    if (base == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    map_populate(base, (size_t)1 << k, &flags, pool->init_threads, pool->narenas);
+    // Whether the side tables can be locked as well is only known once
+    // they are mapped, so keep what was asked for in case they can not
+    size_t purge_order = pool->purge_order;
+    size_t purge_decay_ms = pool->purge_decay_ms;
+    if (flags & (BUDDY_HUGETLB | BUDDY_MLOCK)) {
+        pool->purge_order = 0;
+        pool->purge_decay_ms = 0;
+    }
+    if (!page_maps_init(pool, k, flags)) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!pool->narenas) {
+        tree_init(pool, base, k, flags);
+        mlock_settle(pool, flags, purge_order, purge_decay_ms);
+        decay_start(pool);
+        return;
+    }
+
+    // The pool only routes requests, each arena is a tree of its own
+    pool->kval_m = k;
+    pool->numbytes = (size_t)1 << k;
+    pool->base = base;
+    pool->flags = flags;
+    avail_init(pool);
+    pool->arena_k = k - (size_t)__builtin_ctzll(pool->narenas);
+    pool->arena = mmap(NULL, pool->narenas * sizeof(struct buddy_pool), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool->arena == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < pool->narenas; i++) {
+        arena_page_maps(pool, i);
+        pool->arena[i].init_threads = pool->init_threads;
+        tree_init(&pool->arena[i], (char *)base + (i << pool->arena_k), pool->arena_k, flags);
+        pool->flags &= pool->arena[i].flags | ~BUDDY_MLOCK;
+    }
+    mlock_settle(pool, flags, purge_order, purge_decay_ms);
+    decay_start(pool);
+}
+
+/* "BUDDYPL1" read as a little endian word, the 1 is the format version */
+#define BUDDY_FILE_MAGIC UINT64_C(0x314c505944445542)
+
+/* The side table of a pool file starts this far in */
+#define BUDDY_FILE_HDR 4096
+
+/**
+ * The control block at the start of a pool file. Everything in the file
+ * is relative to its start or to the base of the pool, never a pointer.
+ */
+struct buddy_file {
+    uint64_t magic;             // BUDDY_FILE_MAGIC, written last when the file is set up
+    uint64_t kval_m;            // order of the pool
+    uint64_t data_off;          // where the managed memory starts in the file
+    uint64_t clean;             // set by buddy_destroy, nfree is up to date
+    uint64_t root;              // offset of the root object plus one, 0 for none
+    uint64_t nfree[MAX_K];      // free blocks of each order when the pool was closed, live if shared
+    uint64_t shared;            // buddy_init_shared: the fields below are set up
+    uint64_t avail_bits;        // live pool->avail_bits of a shared pool
+    uint64_t free_hint[MAX_K];  // live pool->free_hint of a shared pool
+    pthread_mutex_t lock;       // robust and process shared, guards the shared pool
+};
+
+_Static_assert(sizeof(struct buddy_file) <= BUDDY_FILE_HDR, "control block does not fit");
+
+/**
+ * Offset of the managed memory in the file of a 2^k pool. It is kept
+ * 2MiB aligned so the file can be mapped whatever the page size is.
+ */
+static size_t file_data_off(size_t k) {
+    size_t align = (size_t)1 << BUDDY_HUGE_K;
+    return (BUDDY_FILE_HDR + meta_size(k) + align - 1) & ~(align - 1);
+}
+
+/**
+ * Check a control block read from a file of file_size bytes before any of
+ * it is trusted. want is the order the caller asked for or 0.
+ */
+static bool file_valid(const struct buddy_file *f, off_t file_size, size_t want) {
+    if (f->magic != BUDDY_FILE_MAGIC || f->kval_m < MIN_K || f->kval_m >= MAX_K ||
+        (want && want != f->kval_m)) {
+        return false;
+    }
+    size_t k = f->kval_m;
+    if (f->data_off != file_data_off(k) || (uint64_t)file_size != f->data_off + ((uint64_t)1 << k) ||
+        f->root > ((uint64_t)1 << k)) {
+        return false;
+    }
+    for (size_t j = 0; j < MAX_K; j++) {
+        uint64_t most = j >= SMALLEST_K && j <= k ? (uint64_t)1 << (k - j) : 0;
+        if (f->nfree[j] > most) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Map 2^k bytes of a file from offset off aligned like map_pool does.
+ */
+static void *map_file(int fd, size_t off, size_t k) {
+    size_t size = (size_t)1 << k;
+    char *hole = map_aligned(size, (size_t)1 << (k < BASE_ALIGN_K ? k : BASE_ALIGN_K));
+    if (hole == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    // Replaces our own reservation
+    void *base = mmap(hole, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, (off_t)off);
+    if (base == MAP_FAILED) {
+        munmap(hole, size);
+    }
+    return base;
+}
+
+/**
+ * Restore the free block counters of a reattached file pool. If the pool
+ * was not closed cleanly they are counted from the bitmaps instead.
+ */
+static void file_counts(struct buddy_pool *pool, bool clean) {
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        if (clean) {
+            pool->nfree[k] = pool->file->nfree[k];
+        } else {
+            size_t words = ((((size_t)1 << (pool->kval_m - k)) + 63) / 64);
+            pool->nfree[k] = 0;
+            for (size_t w = 0; w < words; w++) {
+                pool->nfree[k] += (size_t)__builtin_popcountll(pool->free_map[k][w]);
+            }
+        }
+        if (pool->nfree[k]) {
+            pool->avail_bits |= BIT(k);
+        }
+    }
+}
+
+static void file_save(struct buddy_pool *pool) {
+    for (size_t k = 0; k < MAX_K; k++) {
+        pool->file->nfree[k] = pool->nfree[k];
+    }
+}
+
+/**
+ * Copy the counters of a shared pool between the control block and the
+ * process local struct buddy_pool, the caller holds the shared lock.
+ */
+static void shared_load(struct buddy_pool *pool) {
+    struct buddy_file *f = pool->file;
+    pool->avail_bits = f->avail_bits;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        pool->nfree[k] = f->nfree[k];
+        pool->free_hint[k] = f->free_hint[k];
+    }
+}
+
+static void shared_store(struct buddy_pool *pool) {
+    struct buddy_file *f = pool->file;
+    f->avail_bits = pool->avail_bits;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++) {
+        f->nfree[k] = pool->nfree[k];
+        f->free_hint[k] = pool->free_hint[k];
+    }
+}
+
+static void shared_lock(struct buddy_pool *pool) {
+    int err = pthread_mutex_lock(&pool->file->lock);
+    if (err == EOWNERDEAD) {
+        // The last owner died halfway through, trust only the bitmaps
+        pthread_mutex_consistent(&pool->file->lock);
+        pool->avail_bits = 0;
+        memset(pool->free_hint, 0, sizeof(pool->free_hint));
+        file_counts(pool, false);
+        shared_store(pool);
+    } else if (err != 0) {
+        // Going on without the lock would corrupt the pool for every process
+        errno = err;
+        perror("pthread_mutex_lock failed");
+        exit(EXIT_FAILURE);
+    }
+    shared_load(pool);
+}
+
+static void shared_unlock(struct buddy_pool *pool) {
+    shared_store(pool);
+    pthread_mutex_unlock(&pool->file->lock);
+}
+
+/**
+ * Set up a new pool of order want (0 for the default) in the empty file
+ * open at fd, or reattach the pool in it. A shared pool also sets up or
+ * checks the shared lock. The fd stays open.
+ * @return 0 or -1 with errno set
+ */
+static int file_open(struct buddy_pool *pool, int fd, size_t want, bool shared) {
+    struct stat st;
+    struct buddy_file hdr;
+    size_t k = want ? want : DEFAULT_K;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    bool fresh = st.st_size == 0;
+    if (fresh) {
+        if (k >= MAX_K) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (ftruncate(fd, (off_t)(file_data_off(k) + ((size_t)1 << k))) != 0) {
+            return -1;
+        }
+    } else {
+        if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+            !file_valid(&hdr, st.st_size, want) || hdr.shared != shared) {
+            errno = EINVAL;
+            return -1;
+        }
+        k = hdr.kval_m;
+    }
+
+    size_t data_off = file_data_off(k);
+    struct buddy_file *f = mmap(NULL, data_off, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (f == MAP_FAILED) {
+        return -1;
+    }
+    void *base = map_file(fd, data_off, k);
+    if (base == MAP_FAILED) {
+        int err = errno;
+        munmap(f, data_off);
+        errno = err;
+        return -1;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+    pool->kval_m = k;
+    pool->numbytes = (size_t)1 << k;
+    pool->base = base;
+    pool->flags = BUDDY_NO_HEADER | BUDDY_OUT_OF_LINE | (shared ? BUDDY_SHARED : 0);
+    pool->meta = f;
+    pool->meta_bytes = data_off;
+    pool->file = f;
+    avail_init(pool);
+    meta_layout(pool, (char *)f + BUDDY_FILE_HDR);
+    pthread_mutex_init(&pool->big_lock, NULL);
+    if (fresh) {
+        f->kval_m = k;
+        f->data_off = data_off;
+        block_push(pool, base, k);
+        if (shared) {
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+            pthread_mutex_init(&f->lock, &attr);
+            pthread_mutexattr_destroy(&attr);
+            shared_store(pool);
+            f->shared = 1;
+        }
+        f->magic = BUDDY_FILE_MAGIC;
+    } else if (!shared) {
+        file_counts(pool, f->clean);
+    }
+    f->clean = 0;
+    return 0;
+}
+
+int buddy_init_file(struct buddy_pool *pool, const char *path, size_t size) {
+    if (!pool || !path) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = file_open(pool, fd, size ? pool_order(size) : 0, false);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ret;
+}
+
+int buddy_init_shared(struct buddy_pool *pool, size_t size) {
+    if (!pool) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = memfd_create("buddy_pool", MFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (file_open(pool, fd, pool_order(size), true) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+int buddy_attach_shared(struct buddy_pool *pool, int fd) {
+    struct stat st;
+    if (!pool || fstat(fd, &st) != 0 || st.st_size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return file_open(pool, fd, 0, true);
+}
+
+int buddy_sync(struct buddy_pool *pool) {
+    if (!pool || !pool->file) {
+        errno = EINVAL;
+        return -1;
+    }
+    // The counters of a shared pool are always up to date in the file
+    if (!(pool->flags & BUDDY_SHARED)) {
+        file_save(pool);
+    }
+    if (msync(pool->meta, pool->meta_bytes, MS_SYNC) != 0 ||
+        msync(pool->base, pool->numbytes, MS_SYNC) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void *buddy_file_root(struct buddy_pool *pool) {
+    if (!pool || !pool->file || !pool->file->root) {
+        return NULL;
+    }
+    return (char *)pool->base + (pool->file->root - 1);
+}
+
+void buddy_file_set_root(struct buddy_pool *pool, void *ptr) {
+    if (!pool || !pool->file) {
+        return;
+    }
+    pool->file->root = ptr ? (uint64_t)((uintptr_t)ptr - (uintptr_t)pool->base) + 1 : 0;
+}
+
+struct avail *buddy_calc(struct buddy_pool *pool, struct avail *block) {
+    uintptr_t offset = (uintptr_t)block - (uintptr_t)pool->base;
+    size_t block_size = (size_t)1 << block->kval;
+    uintptr_t buddy_offset = offset ^ block_size;
+    return (struct avail *)((uintptr_t)pool->base + buddy_offset);
+}
+
+/**
+ * Header at the start of the mapping of a request that bypassed the pool.
+ * The caller's memory starts BIG_HDR bytes in.
+ */
+struct buddy_big {
+    struct buddy_big *next;
+    struct buddy_big *prev;
+    size_t len;                 /*Bytes mapped, header included*/
+};
+
+#define BIG_HDR 64
+_Static_assert(sizeof(struct buddy_big) <= BIG_HDR, "BIG_HDR is too small");
+
+static inline bool in_pool(struct buddy_pool *pool, void *ptr) {
+    return (uintptr_t)ptr - (uintptr_t)pool->base < pool->numbytes ||
+           (pool->nregions && region_of(pool, ptr));
+}
+
+static inline struct buddy_big *big_of(void *ptr) {
+    return (struct buddy_big *)((char *)ptr - BIG_HDR);
+}
+
+static inline void big_lock(struct buddy_pool *pool) {
+    if (pool->flags & BUDDY_THREAD_SAFE) {
+        pthread_mutex_lock(&pool->big_lock);
+    }
+}
+
+static inline void big_unlock(struct buddy_pool *pool) {
+    if (pool->flags & BUDDY_THREAD_SAFE) {
+        pthread_mutex_unlock(&pool->big_lock);
+    }
+}
 
-size_t btok(size_t bytes) {
-    if (bytes == 0) {
-        return 0;
+static void big_link(struct buddy_pool *pool, struct buddy_big *big) {
+    big_lock(pool);
+    big->prev = NULL;
+    big->next = pool->big;
+    if (big->next) {
+        big->next->prev = big;
     }
-    // Include the size of the header
-    bytes += sizeof(struct avail);
-    size_t k = SMALLEST_K;
-    size_t block_size = (size_t)1 << k;
-    while (block_size < bytes) {
-        k++;
-        block_size <<= 1;
+    pool->big = big;
+    big_unlock(pool);
+}
+
+/**
+ * Unlink a mapping, the caller must hold big_lock.
+ */
+static void big_unlink(struct buddy_pool *pool, struct buddy_big *big) {
+    if (big->prev) {
+        big->prev->next = big->next;
+    } else {
+        pool->big = big->next;
+    }
+    if (big->next) {
+        big->next->prev = big->prev;
     }
-    return k;
 }
 
-void buddy_init(struct buddy_pool *pool, size_t size) {
-    if (!pool) {
-        return;
+/**
+ * Map size bytes of fresh, zeroed memory outside the pool.
+ */
+static void *big_alloc(struct buddy_pool *pool, size_t size) {
+    if (size > SIZE_MAX - BIG_HDR - 4096) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t len = (size + BIG_HDR + 4095) & ~(size_t)4095;
+    struct buddy_big *big = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (big == MAP_FAILED) {
+        errno = ENOMEM;
+        return NULL;
     }
+    big->len = len;
+    big_link(pool, big);
+    return (char *)big + BIG_HDR;
+}
 
-    size_t k = MIN_K;
-    if (size == 0) {
-        k = DEFAULT_K;
+static void big_free(struct buddy_pool *pool, void *ptr) {
+    struct buddy_big *big = big_of(ptr);
+    big_lock(pool);
+    big_unlink(pool, big);
+    big_unlock(pool);
+    munmap(big, big->len);
+}
+
+/**
+ * Resize a mapping with mremap, which may move it but never copies.
+ * @return the new pointer or NULL with the mapping left as it was
+ */
+static void *big_realloc(struct buddy_pool *pool, void *ptr, size_t size) {
+    if (size > SIZE_MAX - BIG_HDR - 4096) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t len = (size + BIG_HDR + 4095) & ~(size_t)4095;
+    struct buddy_big *big = big_of(ptr);
+    // The neighbours point at the header, hold the lock until they are fixed
+    big_lock(pool);
+    struct buddy_big *moved = mremap(big, big->len, len, MREMAP_MAYMOVE);
+    if (moved == MAP_FAILED) {
+        big_unlock(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    moved->len = len;
+    if (moved->prev) {
+        moved->prev->next = moved;
+    } else {
+        pool->big = moved;
+    }
+    if (moved->next) {
+        moved->next->prev = moved;
+    }
+    big_unlock(pool);
+    return (char *)moved + BIG_HDR;
+}
+
+/**
+ * True if a request of size bytes bypasses the pool.
+ */
+static inline bool big_size(struct buddy_pool *pool, size_t size) {
+    return pool->mmap_threshold && size >= pool->mmap_threshold;
+}
+
+/**
+ * Reserve a block of order k from the per thread cache, the lock-free
+ * stacks or the trees, whichever this pool uses.
+ */
+static struct avail *malloc_block(struct buddy_pool *pool, size_t k) {
+    struct avail *block = NULL;
+    struct tcache *tc = NULL;
+    if (pool->flags & BUDDY_LOCK_FREE) {
+        block = lf_alloc(pool, k);
+    } else if (tcache_order(pool, k) && (tc = tcache_get(pool))) {
+        block = tcache_alloc(tc, k);
     } else {
-        size_t actual_size = (size_t)1 << MIN_K;
-        while (actual_size < size) {
-            actual_size <<= 1;
-            k++;
+        locked_alloc(pool, k, &block, 1);
+    }
+    return block;
+}
+
+void *buddy_malloc(struct buddy_pool *pool, size_t size) {
+    if (!pool || size == 0) {
+        return NULL;
+    }
+
+    if (big_size(pool, size)) {
+        return big_alloc(pool, size);
+    }
+    size_t k = hdr_btok(size, pool_hdr(pool));
+    if (k > pool->kval_m) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if ((pool->flags & BUDDY_SLAB) && size <= BUDDY_SLAB_MAX) {
+        void *ptr = NULL;
+        if (!locked_slab_alloc(pool, size, &ptr, 1)) {
+            errno = ENOMEM;
         }
+        return ptr;
     }
 
-    pool->kval_m = k;
-    pool->numbytes = (size_t)1 << k;
+    struct avail *block = malloc_block(pool, k);
+    if (!block) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    block_handout(pool, block, k);
+    return block_ptr(pool, block);
+}
 
-    // Initialize sentinel nodes
-    for (size_t i = 0; i < MAX_K; i++) {
-        pool->avail[i].tag = BLOCK_UNUSED;
-        pool->avail[i].kval = i;
-        pool->avail[i].next = &pool->avail[i];
-        pool->avail[i].prev = &pool->avail[i];
+void *buddy_calloc(struct buddy_pool *pool, size_t nmemb, size_t size) {
+    if (!pool || nmemb == 0 || size == 0) {
+        return NULL;
+    }
+    if (nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size *= nmemb;
+    if (big_size(pool, size)) {
+        // Fresh mappings are zero already
+        return big_alloc(pool, size);
     }
 
-    pool->base = mmap(NULL, pool->numbytes, PROT_READ | PROT_WRITE,
-                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (pool->base == MAP_FAILED) {
-        perror("mmap failed");
-        exit(EXIT_FAILURE);
+    size_t k = hdr_btok(size, pool_hdr(pool));
+    if (k > pool->kval_m || ((pool->flags & BUDDY_SLAB) && size <= BUDDY_SLAB_MAX)) {
+        void *ptr = buddy_malloc(pool, size);
+        if (ptr) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
     }
 
-    // Set up initial free block
-    struct avail *initial_block = (struct avail *)pool->base;
-    initial_block->tag = BLOCK_AVAIL;
-    initial_block->kval = k;
-    initial_block->next = &pool->avail[k];
-    initial_block->prev = &pool->avail[k];
+    struct avail *block = malloc_block(pool, k);
+    if (!block) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = block_ptr(pool, block);
+    zero_fill(tree_of(pool, block), ptr, size);
+    block_handout(pool, block, k);
+    return ptr;
+}
 
-    pool->avail[k].next = initial_block;
-    pool->avail[k].prev = initial_block;
-    // Sentinel stays BLOCK_UNUSED
+/**
+ * Reserve a block of order k or up for a handle to point at. Blocks of a
+ * region the pool grew into are out of reach of handles, such a block is
+ * given back and the request fails.
+ * @return the block, its order goes to *k
+ */
+static struct avail *handle_block(struct buddy_pool *pool, size_t *k) {
+    size_t shift = buddy_handle_shift(pool);
+    if (*k < shift) {
+        *k = shift;
+    }
+    struct avail *block = *k <= pool->kval_m ? malloc_block(pool, *k) : NULL;
+    if (block && block_off(pool, block) >= pool->numbytes) {
+        locked_free(pool, &block, 1, *k);
+        block = NULL;
+    }
+    if (!block) {
+        errno = ENOMEM;
+    }
+    return block;
 }
 
-struct avail *buddy_calc(struct buddy_pool *pool, struct avail *block) {
-    uintptr_t offset = (uintptr_t)block - (uintptr_t)pool->base;
-    size_t block_size = (size_t)1 << block->kval;
-    uintptr_t buddy_offset = offset ^ block_size;
-    return (struct avail *)((uintptr_t)pool->base + buddy_offset);
+buddy_handle32_t buddy_malloc_handle(struct buddy_pool *pool, size_t size) {
+    if (!pool || size == 0) {
+        return BUDDY_HANDLE_NULL;
+    }
+    size_t k = hdr_btok(size, pool_hdr(pool));
+    struct avail *block = handle_block(pool, &k);
+    if (!block) {
+        return BUDDY_HANDLE_NULL;
+    }
+    block_handout(pool, block, k);
+    return buddy_handle_encode(pool, block_ptr(pool, block));
 }
 
-void *buddy_malloc(struct buddy_pool *pool, size_t size) {
+buddy_handle32_t buddy_calloc_handle(struct buddy_pool *pool, size_t nmemb, size_t size) {
+    if (!pool || nmemb == 0 || size == 0) {
+        return BUDDY_HANDLE_NULL;
+    }
+    if (nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return BUDDY_HANDLE_NULL;
+    }
+    size *= nmemb;
+    size_t k = hdr_btok(size, pool_hdr(pool));
+    struct avail *block = handle_block(pool, &k);
+    if (!block) {
+        return BUDDY_HANDLE_NULL;
+    }
+    void *ptr = block_ptr(pool, block);
+    zero_fill(tree_of(pool, block), ptr, size);
+    block_handout(pool, block, k);
+    return buddy_handle_encode(pool, ptr);
+}
+
+void buddy_free_handle(struct buddy_pool *pool, buddy_handle32_t handle) {
+    if (pool) {
+        buddy_free(pool, buddy_handle_decode(pool, handle));
+    }
+}
+
+void *buddy_memalign(struct buddy_pool *pool, size_t alignment, size_t size) {
     if (!pool || size == 0) {
         return NULL;
     }
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
 
-    size_t k = btok(size);
-    if (k > pool->kval_m) {
+    // Blocks of order a are aligned to 2^a, so the user data has to start
+    // at a multiple of the alignment from the start of the block
+    size_t hdr = pool_hdr(pool);
+    size_t lead = (hdr + alignment - 1) & ~(alignment - 1);
+    size_t a = (size_t)__builtin_ctzll(alignment);
+    size_t k = hdr_btok(size, lead);
+    size_t tree_k = pool->narenas ? pool->arena_k : pool->kval_m;
+    if (k > tree_k || a > tree_k || ((uintptr_t)pool->base & (alignment - 1))) {
         errno = ENOMEM;
         return NULL;
     }
-
-    size_t i = k;
-    while (i <= pool->kval_m && pool->avail[i].next == &pool->avail[i]) {
-        i++;
+    if (lead == hdr && a <= SMALLEST_K && !((pool->flags & BUDDY_SLAB) && size <= BUDDY_SLAB_MAX)) {
+        return buddy_malloc(pool, size);
     }
 
-    if (i > pool->kval_m) {
+    // Take a block of order a, it is aligned, and give back everything
+    // past the first 2^k bytes of it
+    struct avail *block = NULL;
+    if (pool->flags & BUDDY_LOCK_FREE) {
+        block = lf_alloc(pool, k > a ? k : a);
+    } else if (locked_alloc(pool, k > a ? k : a, &block, 1) && k < a) {
+        struct buddy_pool *tree = tree_of(pool, block);
+        pool_lock(tree);
+        pool_shrink(tree, block, a, k);
+        pool_unlock(tree);
+    }
+    if (!block) {
         errno = ENOMEM;
         return NULL;
     }
 
-    // Split blocks until we get the correct size
-    while (i > k) {
-        struct avail *block = pool->avail[i].next;
-        // Remove from avail[i]
-        block->prev->next = block->next;
-        block->next->prev = block->prev;
+    block_handout(pool, block, (pool->flags & BUDDY_LOCK_FREE) && a > k ? a : k);
+    void *ptr = (char *)block + lead;
+    if (lead != hdr) {
+        struct avail *shim = (struct avail *)ptr - 1;
+        shim->tag = BLOCK_ALIGNED;
+        shim->kval = 0;
+        shim->next = block;
+    }
+    return ptr;
+}
 
-        i--;
-        size_t block_size = (size_t)1 << i;
-        struct avail *buddy1 = block;
-        struct avail *buddy2 = (struct avail *)((char *)block + block_size);
+void *buddy_aligned_alloc(struct buddy_pool *pool, size_t alignment, size_t size) {
+    return buddy_memalign(pool, alignment, size);
+}
 
-        buddy1->tag = BLOCK_AVAIL;
-        buddy1->kval = i;
-        buddy2->tag = BLOCK_AVAIL;
-        buddy2->kval = i;
+size_t buddy_malloc_batch(struct buddy_pool *pool, size_t size, size_t count, void **out) {
+    if (!pool || size == 0 || !out) {
+        return 0;
+    }
 
-        // Insert buddy1
-        buddy1->next = pool->avail[i].next;
-        buddy1->prev = &pool->avail[i];
-        pool->avail[i].next->prev = buddy1;
-        pool->avail[i].next = buddy1;
+    size_t got = 0;
+    size_t k = hdr_btok(size, pool_hdr(pool));
+    if (big_size(pool, size)) {
+        while (got < count && (out[got] = big_alloc(pool, size))) {
+            got++;
+        }
+    } else if ((pool->flags & BUDDY_SLAB) && size <= BUDDY_SLAB_MAX) {
+        got = locked_slab_alloc(pool, size, out, count);
+    } else if (k <= pool->kval_m) {
+        struct avail *blocks[64];
+        while (got < count) {
+            size_t want = count - got < 64 ? count - got : 64;
+            size_t n = 0;
+            if (pool->flags & BUDDY_LOCK_FREE) {
+                while (n < want && (blocks[n] = lf_alloc(pool, k))) {
+                    n++;
+                }
+            } else {
+                n = locked_alloc(pool, k, blocks, want);
+            }
+            for (size_t i = 0; i < n; i++) {
+                block_handout(pool, blocks[i], k);
+                out[got++] = block_ptr(pool, blocks[i]);
+            }
+            if (n < want) {
+                break;
+            }
+        }
+    }
+    if (got < count) {
+        errno = ENOMEM;
+    }
+    return got;
+}
 
-        // Insert buddy2
-        buddy2->next = pool->avail[i].next;
-        buddy2->prev = &pool->avail[i];
-        pool->avail[i].next->prev = buddy2;
-        pool->avail[i].next = buddy2;
+/**
+ * Free ptr. maybe_slab is false when the caller knows it is not a slab
+ * object.
+ */
+static void free_ptr(struct buddy_pool *pool, void *ptr, bool maybe_slab) {
+    if (!in_pool(pool, ptr)) {
+        big_free(pool, ptr);
+        return;
     }
 
-    // Allocate from avail[k]
-    struct avail *block = pool->avail[k].next;
-    block->tag = BLOCK_RESERVED;
-    block->prev->next = block->next;
-    block->next->prev = block->prev;
+    struct avail *block = ptr_block(pool, ptr);
+    struct buddy_pool *tree = tree_of(pool, block);
+    if ((pool->flags & BUDDY_SLAB) && maybe_slab) {
+        pool_lock(tree);
+        struct slab *slab = slab_of(tree, ptr);
+        if (slab) {
+            slab_free(pool, tree, slab, ptr);
+        }
+        free_unlock(pool, tree);
+        if (slab) {
+            return;
+        }
+    }
 
-    return (void *)(block + 1);
+    size_t k = block_kval(tree, block);
+    if (pool->flags & BUDDY_LOCK_FREE) {
+        lf_free(pool, block, k);
+        return;
+    }
+    struct tcache *tc = NULL;
+    if (tcache_order(pool, k) && (tc = tcache_get(pool))) {
+        tcache_free(tc, block, k);
+        return;
+    }
+    locked_free(pool, &block, 1, k);
 }
 
 void buddy_free(struct buddy_pool *pool, void *ptr) {
     if (!pool || !ptr) {
         return;
     }
+    free_ptr(pool, ptr, true);
+}
 
-    struct avail *block = (struct avail *)ptr - 1;
-    size_t k = block->kval;
-    block->tag = BLOCK_AVAIL;
+void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size) {
+    if (!pool || !ptr) {
+        return;
+    }
+    // Slabs only serve requests up to BUDDY_SLAB_MAX and their objects
+    // never hold more, anything bigger lives in a block of its own
+    free_ptr(pool, ptr, size <= BUDDY_SLAB_MAX);
+}
 
-    // Coalesce
-    while (k < pool->kval_m) {
-        struct avail *buddy = buddy_calc(pool, block);
-        if (buddy->tag != BLOCK_AVAIL || buddy->kval != k) {
-            break;
+/**
+ * Number of bytes the caller may use at ptr.
+ */
+static size_t ptr_capacity(struct buddy_pool *pool, void *ptr) {
+    if (!in_pool(pool, ptr)) {
+        return big_of(ptr)->len - BIG_HDR;
+    }
+    struct avail *block = ptr_block(pool, ptr);
+    struct buddy_pool *tree = tree_of(pool, block);
+    if (pool->flags & BUDDY_SLAB) {
+        // The slab header of a live object can not change under us
+        struct slab *slab = slab_of(tree, ptr);
+        if (slab) {
+            return slab_sizes[slab->cls];
         }
+    }
+    return ((size_t)1 << block_kval(tree, block)) - (size_t)((char *)ptr - (char *)block);
+}
 
-        // Remove buddy from free list
-        buddy->prev->next = buddy->next;
-        buddy->next->prev = buddy->prev;
+/**
+ * Give the tail of the block at ptr back to the pool if size bytes fit in
+ * a block at least shrink_slack + 1 orders smaller.
+ */
+static void locked_shrink(struct buddy_pool *pool, void *ptr, size_t size) {
+    if (pool->flags & BUDDY_LOCK_FREE) {
+        return;
+    }
+    struct avail *block = ptr_block(pool, ptr);
+    size_t new_k = hdr_btok(size, (size_t)((char *)ptr - (char *)block));
+    struct buddy_pool *tree = tree_of(pool, block);
+    pool_lock(tree);
+    if (!((pool->flags & BUDDY_SLAB) && slab_of(tree, ptr))) {
+        size_t k = block_kval(tree, block);
+        if (k > new_k + pool->shrink_slack) {
+            pool_shrink(tree, block, k, new_k);
+        }
+    }
+    pool_unlock(tree);
+}
 
-        // Merge
-        if (block > buddy) {
-            struct avail *temp = block;
-            block = buddy;
-            buddy = temp;
+/**
+ * Try to make room for size bytes at ptr without moving it.
+ */
+static bool locked_grow(struct buddy_pool *pool, void *ptr, size_t size) {
+    struct avail *block = ptr_block(pool, ptr);
+    size_t new_k = hdr_btok(size, (size_t)((char *)ptr - (char *)block));
+    if (pool->flags & BUDDY_LOCK_FREE || new_k > pool->kval_m) {
+        return false;
+    }
+    struct buddy_pool *tree = tree_of(pool, block);
+    pool_lock(tree);
+    bool grown = !((pool->flags & BUDDY_SLAB) && slab_of(tree, ptr)) &&
+                 pool_grow(tree, block, block_kval(tree, block), new_k);
+    pool_unlock(tree);
+    if (grown) {
+        block_handout(tree, block, new_k);
+    }
+    return grown;
+}
+
+static int cmp_ptr(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+void buddy_free_batch(struct buddy_pool *pool, void **ptrs, size_t count) {
+    if (!pool || !ptrs) {
+        return;
+    }
+    if (pool->flags & BUDDY_LOCK_FREE) {
+        for (size_t i = 0; i < count; i++) {
+            buddy_free(pool, ptrs[i]);
         }
+        return;
+    }
 
-        k++;
-        block->kval = k;
+    if (pool->mmap_threshold) {
+        for (size_t i = 0; i < count; i++) {
+            if (ptrs[i] && !in_pool(pool, ptrs[i])) {
+                big_free(pool, ptrs[i]);
+                ptrs[i] = NULL;
+            }
+        }
     }
 
-    // Insert coalesced block back
-    block->next = pool->avail[k].next;
-    block->prev = &pool->avail[k];
-    pool->avail[k].next->prev = block;
-    pool->avail[k].next = block;
+    if (pool->flags & BUDDY_SLAB) {
+        for (size_t i = 0; i < count; i++) {
+            if (!ptrs[i]) {
+                continue;
+            }
+            struct buddy_pool *tree = tree_of(pool, ptr_block(pool, ptrs[i]));
+            pool_lock(tree);
+            struct slab *slab = slab_of(tree, ptrs[i]);
+            if (slab) {
+                slab_free(pool, tree, slab, ptrs[i]);
+                ptrs[i] = NULL;
+            }
+            free_unlock(pool, tree);
+        }
+    }
+
+    // In address order buddies of the same order end up next to each other,
+    // merge them on a stack like carries in a binary counter. Batches from
+    // buddy_malloc_batch usually arrive sorted already
+    size_t sorted = 1;
+    while (sorted < count && (uintptr_t)ptrs[sorted - 1] <= (uintptr_t)ptrs[sorted]) {
+        sorted++;
+    }
+    if (sorted < count) {
+        qsort(ptrs, count, sizeof(void *), cmp_ptr);
+    }
+    size_t top = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!ptrs[i]) {
+            continue;
+        }
+        struct avail *block = ptr_block(pool, ptrs[i]);
+        ptrs[top++] = block;
+        while (top >= 2) {
+            struct avail *lo = ptrs[top - 2];
+            struct avail *hi = ptrs[top - 1];
+            struct buddy_pool *tree = tree_of(pool, lo);
+            size_t k = block_kval(tree, lo);
+            // hi may sit in another arena or region, only read its order
+            // once it is known to be the buddy of lo
+            if (k >= tree->kval_m || tree_of(pool, hi) != tree ||
+                (block_off(tree, lo) ^ ((uintptr_t)1 << k)) != block_off(tree, hi) ||
+                block_kval(tree, hi) != k) {
+                break;
+            }
+            if (tree->flags & BUDDY_OUT_OF_LINE) {
+                tree->order_map[block_off(tree, hi) >> SMALLEST_K] = 0;
+            }
+            block_reserve(tree, lo, k + 1);
+            top--;
+        }
+    }
+
+    // Whatever is left can only merge with blocks that were already free
+    struct buddy_pool *held = NULL;
+    for (size_t i = 0; i < top; i++) {
+        struct avail *block = ptrs[i];
+        struct buddy_pool *tree = tree_of(pool, block);
+        if (tree != held) {
+            if (held) {
+                free_unlock(pool, held);
+            }
+            pool_lock(tree);
+            held = tree;
+        }
+        pool_free(tree, block, block_kval(tree, block));
+    }
+    if (held) {
+        free_unlock(pool, held);
+    }
 }
 
 void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size) {
@@ -189,29 +2950,228 @@ void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size) {
         return NULL;
     }
 
-    struct avail *block = (struct avail *)ptr - 1;
-    size_t old_size = ((size_t)1 << block->kval) - sizeof(struct avail);
-    if (size <= old_size) {
-        return ptr;
-    } else {
-        void *new_ptr = buddy_malloc(pool, size);
-        if (!new_ptr) {
-            return NULL;
+    size_t old_size = ptr_capacity(pool, ptr);
+    if (!in_pool(pool, ptr)) {
+        if (big_size(pool, size)) {
+            return big_realloc(pool, ptr, size);
         }
-        memcpy(new_ptr, ptr, old_size);
-        buddy_free(pool, ptr);
-        return new_ptr;
+    } else if (size <= old_size) {
+        locked_shrink(pool, ptr, size);
+        return ptr;
+    } else if (!big_size(pool, size) && locked_grow(pool, ptr, size)) {
+        return ptr;
+    }
+
+    void *new_ptr = buddy_malloc(pool, size);
+    if (!new_ptr) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    buddy_free(pool, ptr);
+    return new_ptr;
+}
+
+bool buddy_owns(struct buddy_pool *pool, void *ptr) {
+    if (!pool || !pool->base || !ptr) {
+        return false;
+    }
+    if (in_pool(pool, ptr)) {
+        return true;
+    }
+    // Separate mappings hand out the page right after their header
+    if (((uintptr_t)ptr & 4095) != BIG_HDR) {
+        return false;
+    }
+    bool found = false;
+    big_lock(pool);
+    for (struct buddy_big *big = pool->big; big && !found; big = big->next) {
+        found = big == big_of(ptr);
+    }
+    big_unlock(pool);
+    return found;
+}
+
+size_t buddy_usable_size(struct buddy_pool *pool, void *ptr) {
+    if (!pool || !ptr) {
+        return 0;
     }
+    return ptr_capacity(pool, ptr);
 }
 
 void buddy_destroy(struct buddy_pool *pool) {
     if (!pool || !pool->base) {
         return;
     }
+    decay_join(pool);
+    if (pool->file && !(pool->flags & BUDDY_SHARED)) {
+        // Written back by the kernel after the munmap below
+        file_save(pool);
+        pool->file->clean = 1;
+    }
+    pool->file = NULL;
+    if (pool->tcache_orders) {
+        pthread_key_delete(pool->tcache_key);
+        pool->tcache_orders = 0;
+    }
+    if (pool->narenas) {
+        for (size_t i = 0; i < pool->narenas; i++) {
+            tree_destroy(&pool->arena[i]);
+        }
+        munmap(pool->arena, pool->narenas * sizeof(struct buddy_pool));
+        pool->arena = NULL;
+        pool->narenas = 0;
+    } else {
+        tree_destroy(pool);
+    }
+    page_maps_destroy(pool, pool->kval_m);
+    while (pool->big) {
+        struct buddy_big *big = pool->big;
+        pool->big = big->next;
+        munmap(big, big->len);
+    }
+    pthread_mutex_destroy(&pool->big_lock);
+    if (pool->max_regions) {
+        for (size_t i = 0; i < pool->nregions; i++) {
+            if (pool->region[i].numbytes) {
+                region_unmap(pool, &pool->region[i]);
+            }
+            if (pool->flags & BUDDY_THREAD_SAFE) {
+                pthread_mutex_destroy(&pool->region[i].lock);
+            }
+        }
+        munmap(pool->region, region_table_bytes(pool));
+        pthread_mutex_destroy(&pool->region_lock);
+        pool->region = NULL;
+        pool->region_index = NULL;
+        pool->nregions = 0;
+        pool->max_regions = 0;
+    }
     munmap(pool->base, pool->numbytes);
     pool->base = NULL;
 }
 
+/**
+ * Add the counters of one tree to out.
+ */
+static void tree_stats(struct buddy_pool *tree, struct buddy_stats *out) {
+    out->purged_bytes += __atomic_load_n(&tree->purged_bytes, __ATOMIC_RELAXED);
+    out->purges += __atomic_load_n(&tree->purges, __ATOMIC_RELAXED);
+    out->reused_purged_pages += __atomic_load_n(&tree->reused_purged_pages, __ATOMIC_RELAXED);
+}
+
+void buddy_stats(struct buddy_pool *pool, struct buddy_stats *out) {
+    if (!pool || !out) {
+        return;
+    }
+    memset(out, 0, sizeof(*out));
+    if (pool->narenas) {
+        for (size_t i = 0; i < pool->narenas; i++) {
+            tree_stats(&pool->arena[i], out);
+        }
+    } else {
+        tree_stats(pool, out);
+    }
+    size_t regions = __atomic_load_n(&pool->nregions, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < regions; i++) {
+        tree_stats(&pool->region[i], out);
+    }
+}
+
+/**
+ * Whether a pool has locks for buddy_fork_prepare to take.
+ */
+static inline bool fork_locks(struct buddy_pool *pool) {
+    return pool && pool->base && (pool->flags & BUDDY_THREAD_SAFE) && !(pool->flags & BUDDY_SHARED);
+}
+
+void buddy_fork_prepare(struct buddy_pool *pool) {
+    if (!fork_locks(pool)) {
+        return;
+    }
+    // Threads only ever nest a region's lock inside the region lock
+    if (pool->narenas) {
+        for (size_t i = 0; i < pool->narenas; i++) {
+            pthread_mutex_lock(&pool->arena[i].lock);
+        }
+    } else {
+        pthread_mutex_lock(&pool->lock);
+    }
+    if (pool->max_regions) {
+        pthread_mutex_lock(&pool->region_lock);
+        for (size_t i = 0; i < pool->nregions; i++) {
+            pthread_mutex_lock(&pool->region[i].lock);
+        }
+    }
+    pthread_mutex_lock(&pool->big_lock);
+    if (pool->free_since) {
+        pthread_mutex_lock(&pool->decay_lock);
+    }
+}
+
+/**
+ * Release the locks buddy_fork_prepare took, in reverse order.
+ */
+static void fork_unlock(struct buddy_pool *pool) {
+    if (!fork_locks(pool)) {
+        return;
+    }
+    if (pool->free_since) {
+        pthread_mutex_unlock(&pool->decay_lock);
+    }
+    pthread_mutex_unlock(&pool->big_lock);
+    if (pool->max_regions) {
+        for (size_t i = pool->nregions; i-- > 0;) {
+            pthread_mutex_unlock(&pool->region[i].lock);
+        }
+        pthread_mutex_unlock(&pool->region_lock);
+    }
+    if (pool->narenas) {
+        for (size_t i = pool->narenas; i-- > 0;) {
+            pthread_mutex_unlock(&pool->arena[i].lock);
+        }
+    } else {
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void buddy_fork_parent(struct buddy_pool *pool) {
+    fork_unlock(pool);
+}
+
+void buddy_fork_child(struct buddy_pool *pool) {
+    // The forking thread took the locks, so it is still their owner here
+    fork_unlock(pool);
+}
+
+size_t buddy_trim(struct buddy_pool *pool) {
+    if (!pool || !pool->max_regions) {
+        return 0;
+    }
+    size_t bytes = 0;
+    region_lock(pool);
+    for (size_t i = 0; i < pool->nregions; i++) {
+        struct buddy_pool *r = &pool->region[i];
+        pool_lock(r);
+        if (region_empty(r)) {
+            bytes += region_unmap(pool, r);
+        }
+        pool_unlock(r);
+    }
+    region_unlock(pool);
+    return bytes;
+}
+
+void buddy_flush_cache(struct buddy_pool *pool) {
+    if (!pool || !pool->tcache_orders) {
+        return;
+    }
+    struct tcache *tc = pthread_getspecific(pool->tcache_key);
+    if (tc) {
+        pthread_setspecific(pool->tcache_key, NULL);
+        tcache_destroy(tc);
+    }
+}
+
 int myMain(int argc, char** argv) {
     // Optional test runner, currently unused.
     return 0;
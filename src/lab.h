@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 
 #ifdef __cplusplus
@@ -37,6 +38,203 @@ extern "C"
 #define BLOCK_AVAIL    1  /*Block is available to allocate*/
 #define BLOCK_RESERVED 0  /*Block has been handed to user*/
 #define BLOCK_UNUSED   3  /*Block is not used at all*/
+#define BLOCK_PENDING  2  /*BUDDY_LOCK_FREE: free block claimed by a merge that its popper finishes*/
+#define BLOCK_SLAB     4  /*BUDDY_SLAB: block has been carved into small objects*/
+#define BLOCK_ALIGNED  5  /*Header in front of an aligned allocation, next is the real block*/
+
+  /**
+   * Flags for struct buddy_options.
+   *
+   * BUDDY_OUT_OF_LINE keeps the tag/kval/free list state of every block in a
+   * side table (one bitmap per order plus an order map) that lives outside
+   * the managed memory. Free blocks are never written, so splitting a large
+   * block does not fault in pages that the application has not used yet.
+   */
+#define BUDDY_OUT_OF_LINE 0x1  /*Block metadata lives in a side table*/
+
+  /**
+   * BUDDY_NO_HEADER hands out whole blocks with no struct avail in front of
+   * them, so a 4096 byte request uses a 4096 byte block instead of an 8KiB
+   * one. buddy_free and buddy_realloc find the order of the block in the
+   * order map. Implies BUDDY_OUT_OF_LINE.
+   */
+#define BUDDY_NO_HEADER   0x2  /*Allocations carry no struct avail header*/
+
+  /**
+   * BUDDY_THREAD_SAFE guards the pool with a mutex so it can be shared by
+   * threads. Setting buddy_options.tcache_orders also gives every thread a
+   * private cache of free blocks for the smallest orders, which is refilled
+   * and flushed in batches of BUDDY_TCACHE_BATCH under the mutex.
+   */
+#define BUDDY_THREAD_SAFE 0x4  /*The pool may be used from several threads*/
+
+  /**
+   * Per thread cache limits. A thread caches at most BUDDY_TCACHE_MAX blocks
+   * of each of the orders SMALLEST_K..SMALLEST_K+tcache_orders-1.
+   */
+#define BUDDY_TCACHE_ORDERS_MAX 8
+#define BUDDY_TCACHE_MAX        64
+#define BUDDY_TCACHE_BATCH      32
+
+  /**
+   * Setting buddy_options.arenas splits the mapping into that many
+   * independent trees (rounded up to a power of two), each with its own lock.
+   * buddy_malloc serves the calling thread from the arena of the CPU it runs
+   * on and buddy_free returns a block to its arena based on its address.
+   * An arena is never smaller than 2^MIN_K bytes. BUDDY_ARENAS_PER_CPU asks
+   * for one arena per configured CPU.
+   */
+#define BUDDY_ARENAS_PER_CPU ((size_t)-1)
+
+  /**
+   * BUDDY_LOCK_FREE replaces the avail lists with lock free stacks whose
+   * heads are base relative offsets tagged with a counter against ABA.
+   * Ownership of a block moves with compare and swap on its tag/kval pair:
+   * a pop turns BLOCK_AVAIL into BLOCK_RESERVED and a free claims its buddy
+   * by turning BLOCK_AVAIL into BLOCK_PENDING. A pending buddy is still on
+   * its stack, so whoever pops it next finishes the merge. When an
+   * allocation finds every stack empty one thread drains the stacks to
+   * finish any merges that are still outstanding and the allocation is
+   * retried. Lock free pools always use headers and ignore every other
+   * option.
+   */
+#define BUDDY_LOCK_FREE   0x8  /*Free lists are lock free stacks*/
+
+  /**
+   * BUDDY_SLAB serves requests of up to BUDDY_SLAB_MAX bytes from slabs:
+   * blocks of order BUDDY_SLAB_K carved into 8, 16, 24, 32 or 48 byte
+   * objects and tracked with a free bitmap. A 16 byte node then costs 16
+   * bytes instead of a 64 byte block. Slabs are taken from and given back
+   * to the tree they live in, an empty slab goes back to the free lists
+   * unless it is the last one with room in its size class. Regions never
+   * keep an empty slab, so it can not stop them from being released.
+   */
+#define BUDDY_SLAB        0x10 /*Small requests are served from slabs*/
+#define BUDDY_SLAB_K       12
+#define BUDDY_SLAB_MAX     48
+#define BUDDY_SLAB_CLASSES 5
+
+  /**
+   * BUDDY_TRACK_ZERO keeps one bit per 4KiB page of the pool that is set
+   * once anything may have written to the page: when a block that covers it
+   * is handed out or a free list header is stored in it. buddy_calloc only
+   * zeroes the pages whose bit is set, everything else is still the zero
+   * memory that mmap handed us.
+   */
+#define BUDDY_TRACK_ZERO  0x20 /*Remember which pages are still zero for buddy_calloc*/
+
+  /**
+   * Setting buddy_options.max_regions lets a pool grow. When every tree is
+   * out of room the pool maps another region of the same size and manages
+   * it as a tree of its own. A region that becomes completely free again is
+   * unmapped, unless it is the only empty region left; buddy_trim unmaps
+   * that one too. The pool can never hold more than BUDDY_REGIONS_MAX
+   * regions besides its own.
+   */
+#define BUDDY_REGIONS_MAX 64
+
+  /**
+   * Setting buddy_options.purge_order makes the pool hand the pages of free
+   * blocks of that order and up back to the system with
+   * madvise(MADV_DONTNEED) as soon as they are coalesced, so the RSS drops
+   * after a load spike. Pools with headers in free blocks keep the first
+   * page of each block. BUDDY_PURGE_LAZY uses MADV_FREE instead, which lets
+   * the kernel take the pages only when it runs short of memory. Purged
+   * pages and the purged pages used again are counted in struct buddy_stats.
+   */
+#define BUDDY_PURGE_LAZY  0x40 /*Purge with MADV_FREE instead of MADV_DONTNEED*/
+
+  /**
+   * Setting buddy_options.purge_decay_ms as well delays purging: a free
+   * block is only purged once it has stayed free for that many ms, so
+   * memory that is freed and reused right away does not fault back in.
+   * buddy_free just notes when a block became free and a background thread
+   * started by buddy_init_opts looks for blocks past their window
+   * BUDDY_DECAY_STEPS times per window. Implies BUDDY_THREAD_SAFE.
+   */
+#define BUDDY_DECAY_STEPS 4
+
+  /**
+   * BUDDY_HUGETLB backs the pool with huge pages of 2^buddy_options.huge_page_k
+   * bytes (2MiB unless set, 1GiB with 30) from MAP_HUGETLB, which cuts the
+   * TLB misses of random access over a large pool. An order below the 4KiB
+   * page or above the order of the pool falls back to BUDDY_HUGE_K. The
+   * system has to have enough of them reserved. Huge pages can not be given back piecemeal,
+   * so such pools never purge. BUDDY_THP instead aligns the pool to at
+   * least 2MiB and asks for transparent huge pages with MADV_HUGEPAGE.
+   * With both set BUDDY_THP is the fallback for BUDDY_HUGETLB. Whatever
+   * could not be had is cleared from pool->flags, and the pool falls back
+   * to normal pages.
+   */
+#define BUDDY_HUGETLB     0x80  /*Back the pool with MAP_HUGETLB pages*/
+#define BUDDY_THP         0x100 /*Ask for transparent huge pages*/
+#define BUDDY_HUGE_K      21
+
+  /**
+   * BUDDY_PREFAULT faults the whole pool in when it is mapped, with
+   * MADV_POPULATE_WRITE or by touching every page, so buddy_malloc never
+   * hands out memory whose first touch enters the kernel. BUDDY_MLOCK
+   * prefaults it as well and then locks it into RAM. The side tables of
+   * BUDDY_OUT_OF_LINE pools are treated the same. Locked pools never purge.
+   * BUDDY_MLOCK is cleared from pool->flags if RLIMIT_MEMLOCK does not
+   * allow locking the pool and its side tables, such a pool is not locked
+   * at all and purges as buddy_options.purge_order asks.
+   *
+   * Setting buddy_options.init_threads spreads the prefault over that many
+   * threads (at most BUDDY_INIT_THREADS_MAX, BUDDY_INIT_THREADS_PER_CPU for
+   * one per CPU we may run on), each faulting a disjoint slice while pinned
+   * to its own CPU. Pages are placed on the NUMA node that touches them
+   * first, so with arenas the slice of arena i is faulted from a CPU that
+   * buddy_malloc serves from arena i. Arenas beyond the number of CPUs
+   * have no such CPU, arena i is faulted from CPU i modulo that number.
+   */
+#define BUDDY_PREFAULT    0x200 /*Fault the pool in up front*/
+#define BUDDY_MLOCK       0x400 /*Lock the pool into RAM*/
+#define BUDDY_INIT_THREADS_MAX     64
+#define BUDDY_INIT_THREADS_PER_CPU ((size_t)-1)
+
+  /**
+   * Set in pool->flags of a pool made by buddy_init_shared or
+   * buddy_attach_shared. The free block counters of such a pool live in
+   * the shared control block, every call takes its process shared lock
+   * and brings the copy in struct buddy_pool up to date. buddy_init_opts
+   * ignores it in buddy_options.flags.
+   */
+#define BUDDY_SHARED      0x800 /*The pool is shared with other processes*/
+
+  /**
+   * Optional settings for buddy_init_opts. A zeroed struct gives the same
+   * pool as buddy_init.
+   */
+  struct buddy_options
+  {
+    unsigned int flags;         /*Combination of the BUDDY_* flags*/
+    size_t tcache_orders;       /*Orders cached per thread, 0 disables the caches. Implies BUDDY_THREAD_SAFE*/
+    size_t arenas;              /*Split the pool into this many independent trees. Implies BUDDY_THREAD_SAFE*/
+    size_t shrink_slack;        /*buddy_realloc only shrinks blocks more than this many orders too big*/
+    size_t mmap_threshold;      /*Requests of at least this many bytes get their own mapping, 0 never*/
+    size_t max_regions;         /*Extra regions the pool may add when it runs out, 0 never*/
+    size_t purge_order;         /*Free blocks of at least this order are purged, 0 never*/
+    size_t purge_decay_ms;      /*Purge them only after they stayed free this long, 0 at once*/
+    size_t huge_page_k;         /*BUDDY_HUGETLB: order of the huge pages from 12 to the pool's order, BUDDY_HUGE_K otherwise*/
+    size_t init_threads;        /*BUDDY_PREFAULT/BUDDY_MLOCK: threads that fault the pool in, 0 for the caller alone*/
+  };
+
+  /**
+   * Counters of a pool, see buddy_stats.
+   */
+  struct buddy_stats
+  {
+    size_t purged_bytes;        /*Bytes handed back to the system with madvise*/
+    size_t purges;              /*Number of madvise calls that did it*/
+    size_t reused_purged_pages; /*Purged pages handed out again, not the faults they cost*/
+  };
+
+  /* A request served by its own mapping, see buddy_options.mmap_threshold */
+  struct buddy_big;
+
+  /* The control block at the start of a pool file, see buddy_init_file */
+  struct buddy_file;
 
   /**
    * Struct to represent the table of all available blocks do not reorder members
@@ -58,7 +256,48 @@ extern "C"
     size_t kval_m;              /*The max kval of this pool*/
     size_t numbytes;            /*The number of bytes this pool is managing*/
     void *base;                 /*Base address used to scale memory for buddy calculations*/
+    uint64_t avail_bits;        /*Bit k is set when order k has a free block*/
+    unsigned int flags;         /*The BUDDY_* flags this pool was created with*/
+    size_t nfree[MAX_K];        /*Number of free blocks of each order*/
     struct avail avail[MAX_K];  /*The array of available memory blocks*/
+    uint64_t *free_map[MAX_K];  /*BUDDY_OUT_OF_LINE: per order bitmap of free blocks*/
+    size_t free_hint[MAX_K];    /*BUDDY_OUT_OF_LINE: no bits are set in free_map[k] below this word*/
+    unsigned char *order_map;   /*BUDDY_OUT_OF_LINE: kval of each reserved block by SMALLEST_K slot*/
+    void *meta;                 /*BUDDY_OUT_OF_LINE: the side table mapping*/
+    size_t meta_bytes;          /*BUDDY_OUT_OF_LINE: size of the side table mapping*/
+    pthread_mutex_t lock;       /*BUDDY_THREAD_SAFE: guards everything above*/
+    size_t tcache_orders;       /*Number of orders served by the per thread caches*/
+    pthread_key_t tcache_key;   /*Per thread cache of this pool*/
+    size_t narenas;             /*Number of arenas, 0 when the pool is a single tree*/
+    size_t shrink_slack;        /*Orders a block may be oversized before buddy_realloc shrinks it*/
+    size_t arena_k;             /*The kval_m of every arena*/
+    struct buddy_pool *arena;   /*The arenas, arena i manages base + i * 2^arena_k*/
+    void *slab_partial[BUDDY_SLAB_CLASSES]; /*BUDDY_SLAB: slabs of each size class with free objects*/
+    uint64_t lf_head[MAX_K];    /*BUDDY_LOCK_FREE: tagged head of each free stack*/
+    int lf_draining;            /*BUDDY_LOCK_FREE: set while a thread drains the stacks*/
+    uint64_t *zero_map;         /*BUDDY_TRACK_ZERO: one bit per page that may not be zero*/
+    size_t mmap_threshold;      /*Requests this big bypass the pool, 0 when they never do*/
+    struct buddy_big *big;      /*Live mappings of requests that bypassed the pool*/
+    pthread_mutex_t big_lock;   /*BUDDY_THREAD_SAFE: guards big*/
+    size_t max_regions;         /*Most extra regions the pool may have at once*/
+    size_t nregions;            /*Region slots in use, including released ones*/
+    struct buddy_pool *region;  /*The extra regions, each a tree of 2^kval_m bytes*/
+    unsigned char *region_index; /*Region slots by the address they cover, see region_of*/
+    pthread_mutex_t region_lock; /*BUDDY_THREAD_SAFE: guards adding and releasing regions*/
+    size_t purge_order;         /*Free blocks of at least this order are purged, 0 never*/
+    uint64_t *purge_map;        /*One bit per page that has been purged and not touched since*/
+    size_t purged_bytes;        /*Bytes purged by this tree*/
+    size_t purges;              /*madvise calls made by this tree*/
+    size_t reused_purged_pages; /*Purged pages of this tree that were used again*/
+    size_t purge_decay_ms;      /*Free blocks are purged after this many ms, 0 at once*/
+    uint32_t *free_since;       /*purge_decay_ms: ms clock at which each free block became free, by 2^purge_order slot*/
+    pthread_t decay_thread;     /*purge_decay_ms: purges the blocks whose window has passed*/
+    pthread_mutex_t decay_lock; /*purge_decay_ms: guards decay_stop*/
+    pthread_cond_t decay_cond;  /*purge_decay_ms: signalled when the thread has to stop*/
+    bool decay_stop;            /*purge_decay_ms: set by buddy_destroy*/
+    size_t huge_k;              /*BUDDY_HUGETLB/BUDDY_THP: order of the huge pages*/
+    size_t init_threads;        /*Threads that prefault new mappings of this tree*/
+    struct buddy_file *file;    /*buddy_init_file: the control block, the side table follows it*/
   };
 
   /**
@@ -85,12 +324,35 @@ extern "C"
    * If size is zero, the return value will be NULL
    * If pool is NULL, the return value will be NULL
    *
+   * Requests of at least buddy_options.mmap_threshold bytes get a mapping
+   * of their own instead of a block, so one huge buffer does not take the
+   * top orders of the pool. buddy_free unmaps it again and buddy_realloc
+   * resizes it with mremap, which moves pages instead of copying them.
+   *
    * @param pool The memory pool to alloc from
    * @param size The size of the user requested memory block in bytes
    * @return A pointer to the memory block
    */
   void *buddy_malloc(struct buddy_pool *pool, size_t size);
 
+  /**
+   * Allocates count blocks of size bytes each in one go. The order search
+   * and the free list updates are done once per source block instead of
+   * once per allocation: a block large enough for the whole batch is split
+   * once and its pieces are handed out together. Allocations from the same
+   * source block are adjacent in memory.
+   *
+   * If the pool can not satisfy the whole batch the blocks that could be
+   * allocated are still returned and errno is set to ENOMEM.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of every block in bytes
+   * @param count The number of blocks wanted
+   * @param out Receives the pointers to the blocks
+   * @return The number of blocks stored in out
+   */
+  size_t buddy_malloc_batch(struct buddy_pool *pool, size_t size, size_t count, void **out);
+
   /**
    * A block of memory previously allocated by a call to malloc,
    * calloc or realloc is deallocated, making it available again
@@ -108,6 +370,76 @@ extern "C"
    */
   void buddy_free(struct buddy_pool *pool, void *ptr);
 
+  /**
+   * Same as buddy_free for a caller that knows how big the allocation is,
+   * like a C++ sized delete. A BUDDY_SLAB pool has to look under the tree
+   * lock whether ptr is a slab object. A size above BUDDY_SLAB_MAX rules
+   * that out, so the block goes straight back to the thread cache or the
+   * free lists.
+   *
+   * @param pool The memory pool
+   * @param ptr Pointer to the memory block to free
+   * @param size The size it was allocated with, or anything up to
+   * buddy_usable_size. 0 if it is not known.
+   */
+  void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size);
+
+  /**
+   * Allocates an array of nmemb elements of size bytes each, set to zero.
+   * Pools made with BUDDY_TRACK_ZERO skip the pages that were never written
+   * since they were mapped, others zero the whole request.
+   *
+   * @param pool The memory pool
+   * @param nmemb The number of elements
+   * @param size The size of one element
+   * @return the zeroed memory, or NULL with errno set to ENOMEM if there is
+   * no room or nmemb * size overflows
+   */
+  void *buddy_calloc(struct buddy_pool *pool, size_t nmemb, size_t size);
+
+  /**
+   * Allocates size bytes aligned to alignment, which must be a power of two.
+   * Pools are mapped aligned to their own size (up to 1GiB), so a block of
+   * order k is aligned to 2^k in memory and the allocator only has to pick
+   * a block of the right order. The block is split back down to the order
+   * that fits size, so with BUDDY_NO_HEADER the buffer costs exactly what a
+   * plain buddy_malloc of max(size, alignment) would. With headers the
+   * data starts alignment bytes into the block and a second header sits
+   * right in front of it. Lock-free pools keep the whole aligned block.
+   *
+   * The result can be passed to buddy_free and buddy_realloc as usual.
+   * A realloc that has to move the data does not keep the alignment.
+   * Aligned requests never bypass the pool, whatever mmap_threshold says.
+   *
+   * @param pool The memory pool
+   * @param alignment The alignment in bytes, a power of two
+   * @param size The number of bytes
+   * @return the aligned pointer, or NULL with errno set to EINVAL for a bad
+   * alignment or ENOMEM if there is no room
+   */
+  void *buddy_memalign(struct buddy_pool *pool, size_t alignment, size_t size);
+
+  /**
+   * Same as buddy_memalign, for code written against C11 aligned_alloc.
+   */
+  void *buddy_aligned_alloc(struct buddy_pool *pool, size_t alignment, size_t size);
+
+  /**
+   * Frees count blocks in one go. The pointers are sorted by address and
+   * buddies within the batch are merged with each other before the free
+   * lists are touched, so releasing thousands of sibling blocks costs a
+   * sort plus one free list update per merged block instead of walking up
+   * the buddy chain for every pointer. Blocks freed this way skip the per
+   * thread caches. NULL entries are ignored.
+   *
+   * The contents of ptrs are clobbered.
+   *
+   * @param pool The memory pool
+   * @param ptrs The blocks to free
+   * @param count The number of entries in ptrs
+   */
+  void buddy_free_batch(struct buddy_pool *pool, void **ptrs, size_t count);
+
   /**
    * Changes the size of the memory block pointed to by ptr.
    * The function may move the memory block to a new location
@@ -117,6 +449,13 @@ extern "C"
    * moved to a new location. If the new size is larger,
    * the value of the newly allocated portion is indeterminate.
    *
+   * A growing block stays where it is when it is the lower half of its
+   * buddy pair at every order up to the new one and all of those upper
+   * buddies are free, so buffers that keep doubling are not copied. A
+   * shrinking block also stays where it is and the upper halves it no longer
+   * needs go back to the free lists, unless it is within
+   * buddy_options.shrink_slack orders of the new size.
+   *
    * In case that ptr is a null pointer, the function behaves
    * like malloc, assigning a new block of size bytes and
    * returning a pointer to its beginning.
@@ -131,6 +470,28 @@ extern "C"
    */
   void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size);
 
+  /**
+   * Number of bytes the caller may use at ptr, which is at least what was
+   * asked for. This is the rest of the block after any header, the slab
+   * object size or the usable part of a request's own mapping.
+   *
+   * @param pool The memory pool
+   * @param ptr Pointer returned by one of the allocation functions
+   * @return the usable size, 0 if ptr is NULL
+   */
+  size_t buddy_usable_size(struct buddy_pool *pool, void *ptr);
+
+  /**
+   * Whether ptr was handed out by this pool, from its trees, its regions
+   * or a mapping of its own. Pointers into the pool's memory always count,
+   * a separate mapping is looked up in the list of live ones.
+   *
+   * @param pool The memory pool
+   * @param ptr Any pointer
+   * @return true if ptr can be passed to buddy_free
+   */
+  bool buddy_owns(struct buddy_pool *pool, void *ptr);
+
   /**
    * Initialize a new memory pool using the buddy algorithm. Internally,
    * this function uses mmap to get a block of memory to manage so should be
@@ -152,6 +513,106 @@ extern "C"
    */
   void buddy_init(struct buddy_pool *pool, size_t size);
 
+  /**
+   * Same as buddy_init but with extra settings, see struct buddy_options.
+   * Passing NULL for opts is the same as calling buddy_init.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param size The size of the pool in bytes.
+   * @param opts The pool settings or NULL for the defaults
+   */
+  void buddy_init_opts(struct buddy_pool *pool, size_t size, const struct buddy_options *opts);
+
+  /**
+   * Initialize a pool that lives in a file, so its contents survive a
+   * restart. The file is mapped with MAP_SHARED and holds a control block,
+   * the out of line side table (free bitmaps and order map, all relative
+   * to the base) and the managed memory. The pool always works like
+   * BUDDY_NO_HEADER and is not thread safe.
+   *
+   * A missing or empty file is set up as a new pool of size bytes, rounded
+   * like buddy_init. An existing file is validated and reattached as it
+   * is: the free block counters are read back from the control block, so
+   * reopening costs O(orders) plus the page faults of whatever is used
+   * afterwards. A file that was not closed with buddy_destroy (the process
+   * died) has its counters recounted from the bitmaps instead; blocks that
+   * were being allocated or freed right then may be leaked.
+   *
+   * The pool is mapped at a different address every time, so data in it
+   * must refer to other data in it by offset from pool->base. One pointer
+   * can be kept with buddy_file_set_root.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param path The pool file
+   * @param size The size of a new pool in bytes, 0 for the default. For an
+   * existing file it must be 0 or match the file
+   * @return 0, or -1 with errno set: EINVAL if the file is not a pool file
+   * or does not match size, anything open or mmap can fail with otherwise
+   */
+  int buddy_init_file(struct buddy_pool *pool, const char *path, size_t size);
+
+  /**
+   * Create a pool that several processes can allocate from and free to,
+   * for example workers forked after this call or processes the returned
+   * fd is passed to. It is a file pool (see buddy_init_file) in an
+   * anonymous memfd, whose control block also holds the free block
+   * counters and a robust process shared mutex. Every process may map it
+   * at a different address, so anything stored in the pool has to refer
+   * to the pool by offset. Blocks can be handed from one process to
+   * another as offsets and freed by either of them.
+   *
+   * If a process dies while it holds the lock the next one to take it
+   * recounts the counters from the bitmaps. Blocks that were being
+   * allocated or freed right then may be leaked.
+   *
+   * Workers forked after this call can use pool as it is. The pool stays
+   * alive as long as any process has it mapped or holds the fd.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param size The size of the pool in bytes, 0 for the default
+   * @return a file descriptor of the memfd for buddy_attach_shared, which
+   * the caller closes, or -1 with errno set
+   */
+  int buddy_init_shared(struct buddy_pool *pool, size_t size);
+
+  /**
+   * Map a pool made by buddy_init_shared in another process, from a copy
+   * of its fd. The fd can be closed afterwards.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param fd The memfd of the pool
+   * @return 0, or -1 with errno set, EINVAL if fd is not a shared pool
+   */
+  int buddy_attach_shared(struct buddy_pool *pool, int fd);
+
+  /**
+   * Write the free block counters of a file pool to its control block and
+   * flush the whole mapping to the file. buddy_destroy does the same
+   * without waiting for the writes.
+   *
+   * @param pool The memory pool
+   * @return 0, or -1 with errno set if msync fails or the pool is not in a file
+   */
+  int buddy_sync(struct buddy_pool *pool);
+
+  /**
+   * The root object of a file pool, stored as an offset in the control
+   * block so it can be found again after a restart.
+   *
+   * @param pool The memory pool
+   * @return the root set by buddy_file_set_root, or NULL if there is none
+   */
+  void *buddy_file_root(struct buddy_pool *pool);
+
+  /**
+   * Remember ptr, which must point into the pool, as the root object of a
+   * file pool. NULL clears it.
+   *
+   * @param pool The memory pool
+   * @param ptr The new root
+   */
+  void buddy_file_set_root(struct buddy_pool *pool, void *ptr);
+
   /**
    * Inverse of buddy_init.
    *
@@ -162,6 +623,139 @@ extern "C"
    */
   void buddy_destroy(struct buddy_pool *pool);
 
+  /**
+   * Return every block held in the calling thread's cache to the pool. Caches
+   * are flushed automatically when a thread exits, this is only needed to
+   * see a fully coalesced pool while the thread is still running.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_flush_cache(struct buddy_pool *pool);
+
+  /**
+   * Handlers that make a thread safe pool usable in a child forked while
+   * other threads are inside it, for pthread_atfork wrappers.
+   * buddy_fork_prepare takes every lock of the pool in a fixed order: the
+   * arenas or the pool's own tree, the region lock and the regions, the
+   * lock of the separate mappings and the decay lock. buddy_fork_parent and
+   * buddy_fork_child release them again. Blocks in the caches of threads
+   * that do not exist in the child are lost to it. Shared pools keep their
+   * process shared lock out of this.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_fork_prepare(struct buddy_pool *pool);
+  void buddy_fork_parent(struct buddy_pool *pool);
+  void buddy_fork_child(struct buddy_pool *pool);
+
+  /**
+   * Unmap every region the pool added that is completely free right now.
+   *
+   * @param pool The memory pool
+   * @return the number of bytes given back to the system
+   */
+  size_t buddy_trim(struct buddy_pool *pool);
+
+  /**
+   * Read the counters of a pool, summed over its arenas and regions.
+   * A purged page counts as reused when it is handed out again, or when
+   * the allocator writes a free list header into it. That is an upper
+   * bound on the page faults the purging costs, the kernel may not have
+   * taken a page yet, MADV_FREE pages in particular.
+   *
+   * @param pool The memory pool
+   * @param out Receives the counters
+   */
+  void buddy_stats(struct buddy_pool *pool, struct buddy_stats *out);
+
+  /**
+   * A 32 bit stand in for a pointer into a pool, for data structures that
+   * keep many of them. A handle is the offset of a block from pool->base
+   * shifted right by buddy_handle_shift, plus one so that
+   * BUDDY_HANDLE_NULL can stand for NULL. Handles are also valid in every
+   * process that maps a file or shared pool, wherever it maps it.
+   */
+  typedef uint32_t buddy_handle32_t;
+#define BUDDY_HANDLE_NULL 0
+
+  /**
+   * The shift of the handles of a pool: max(SMALLEST_K, kval_m - 31).
+   * Handles reach every block of pools up to 2^37 bytes, one value goes to
+   * BUDDY_HANDLE_NULL. A larger pool shifts one bit more per order, so
+   * blocks it hands out as handles are at least 2^shift bytes.
+   *
+   * @param pool The memory pool
+   * @return the shift
+   */
+  static inline size_t buddy_handle_shift(const struct buddy_pool *pool)
+  {
+    return pool->kval_m > 31 + SMALLEST_K ? pool->kval_m - 31 : SMALLEST_K;
+  }
+
+  /**
+   * Turn a pointer into a handle. ptr must be NULL, come from one of the
+   * handle functions below, or be a buddy_malloc pointer into the pool's
+   * own mapping (not a region, slab object or separate mapping) whose
+   * block starts on a multiple of 2^buddy_handle_shift. buddy_memalign
+   * pointers in pools with headers do not qualify.
+   *
+   * @param pool The memory pool
+   * @param ptr The pointer
+   * @return the handle
+   */
+  static inline buddy_handle32_t buddy_handle_encode(const struct buddy_pool *pool, const void *ptr)
+  {
+    if (!ptr)
+      {
+        return BUDDY_HANDLE_NULL;
+      }
+    size_t hdr = (pool->flags & BUDDY_NO_HEADER) ? 0 : sizeof(struct avail);
+    uintptr_t off = (uintptr_t)ptr - hdr - (uintptr_t)pool->base;
+    return (buddy_handle32_t)((off >> buddy_handle_shift(pool)) + 1);
+  }
+
+  /**
+   * Turn a handle back into a pointer.
+   *
+   * @param pool The memory pool
+   * @param handle The handle
+   * @return the pointer, NULL for BUDDY_HANDLE_NULL
+   */
+  static inline void *buddy_handle_decode(const struct buddy_pool *pool, buddy_handle32_t handle)
+  {
+    if (handle == BUDDY_HANDLE_NULL)
+      {
+        return NULL;
+      }
+    size_t hdr = (pool->flags & BUDDY_NO_HEADER) ? 0 : sizeof(struct avail);
+    return (char *)pool->base + ((size_t)(handle - 1) << buddy_handle_shift(pool)) + hdr;
+  }
+
+  /**
+   * Same as buddy_malloc but returns a handle. The request is always
+   * served by a block of the pool's own mapping of at least
+   * 2^buddy_handle_shift bytes, never by a slab, a separate mapping or a
+   * region.
+   *
+   * @param pool The memory pool
+   * @param size The size of the user requested memory block in bytes
+   * @return the handle, or BUDDY_HANDLE_NULL with errno set to ENOMEM
+   */
+  buddy_handle32_t buddy_malloc_handle(struct buddy_pool *pool, size_t size);
+
+  /**
+   * Same as buddy_calloc but returns a handle, see buddy_malloc_handle.
+   */
+  buddy_handle32_t buddy_calloc_handle(struct buddy_pool *pool, size_t nmemb, size_t size);
+
+  /**
+   * Free the block of a handle, BUDDY_HANDLE_NULL is ignored.
+   *
+   * @param pool The memory pool
+   * @param handle The handle
+   */
+  void buddy_free_handle(struct buddy_pool *pool, buddy_handle32_t handle);
+
   /**
    * @brief Entry to a main function for testing purposes
    *
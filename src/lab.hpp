@@ -0,0 +1,138 @@
+#ifndef LAB_HPP
+#define LAB_HPP
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+#include "lab.h"
+
+namespace buddy
+{
+  namespace detail
+  {
+    /**
+     * Allocate bytes aligned to alignment from pool. Every pool hands out
+     * memory aligned to at least alignof(void *), stricter requests go
+     * through buddy_memalign.
+     *
+     * @throws std::bad_alloc if the pool has no room
+     */
+    inline void *allocate(struct buddy_pool *pool, std::size_t bytes, std::size_t alignment)
+    {
+      if (bytes == 0)
+        {
+          bytes = 1;
+        }
+      void *ptr = alignment <= alignof(void *) ? buddy_malloc(pool, bytes)
+                                               : buddy_memalign(pool, alignment, bytes);
+      if (!ptr)
+        {
+          throw std::bad_alloc();
+        }
+      return ptr;
+    }
+  } // namespace detail
+
+  /**
+   * A std::pmr::memory_resource backed by a buddy pool, for the std::pmr
+   * containers:
+   *
+   *   buddy::memory_resource res(&pool);
+   *   std::pmr::vector<int> v(&res);
+   *
+   * The pool is not owned. It has to outlive the resource and everything
+   * allocated from it, and has to be thread safe if the containers are
+   * used from several threads. Deallocation passes the size on to
+   * buddy_free_sized. Two resources are equal when they share a pool.
+   */
+  class memory_resource : public std::pmr::memory_resource
+  {
+  public:
+    explicit memory_resource(struct buddy_pool *pool) noexcept : pool_(pool) {}
+
+    struct buddy_pool *pool() const noexcept
+    {
+      return pool_;
+    }
+
+  protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+      return detail::allocate(pool_, bytes, alignment);
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t) override
+    {
+      buddy_free_sized(pool_, ptr, bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+      const memory_resource *res = dynamic_cast<const memory_resource *>(&other);
+      return res && res->pool_ == pool_;
+    }
+
+  private:
+    struct buddy_pool *pool_;
+  };
+
+  /**
+   * A classic allocator for the std containers, for code that can not move
+   * to std::pmr:
+   *
+   *   buddy::allocator<int> alloc(&pool);
+   *   std::vector<int, buddy::allocator<int>> v(alloc);
+   *
+   * It only holds the pool pointer, so copies and rebinds are cheap and
+   * compare equal when they share a pool. The same rules as for
+   * buddy::memory_resource apply to the pool.
+   */
+  template <typename T>
+  class allocator
+  {
+  public:
+    using value_type = T;
+
+    explicit allocator(struct buddy_pool *pool) noexcept : pool_(pool) {}
+
+    template <typename U>
+    allocator(const allocator<U> &other) noexcept : pool_(other.pool()) {}
+
+    T *allocate(std::size_t n)
+    {
+      if (n > static_cast<std::size_t>(-1) / sizeof(T))
+        {
+          throw std::bad_array_new_length();
+        }
+      return static_cast<T *>(detail::allocate(pool_, n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept
+    {
+      buddy_free_sized(pool_, ptr, n * sizeof(T));
+    }
+
+    struct buddy_pool *pool() const noexcept
+    {
+      return pool_;
+    }
+
+  private:
+    struct buddy_pool *pool_;
+  };
+
+  template <typename T, typename U>
+  bool operator==(const allocator<T> &a, const allocator<U> &b) noexcept
+  {
+    return a.pool() == b.pool();
+  }
+
+  template <typename T, typename U>
+  bool operator!=(const allocator<T> &a, const allocator<U> &b) noexcept
+  {
+    return a.pool() != b.pool();
+  }
+} // namespace buddy
+
+#endif
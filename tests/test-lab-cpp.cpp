@@ -0,0 +1,144 @@
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "harness/unity.h"
+#include "../src/lab.hpp"
+
+
+void setUp(void) {
+  // set stuff up here
+}
+
+void tearDown(void) {
+  // clean stuff up here
+}
+
+/**
+ * Check that every block of a single tree pool is back on the free lists.
+ */
+static void check_pool_full(struct buddy_pool *pool)
+{
+  for (size_t i = 0; i < pool->kval_m; i++)
+    {
+      assert(pool->nfree[i] == 0);
+    }
+  assert(pool->nfree[pool->kval_m] == 1);
+}
+
+void test_buddy_memory_resource(void)
+{
+  fprintf(stderr, "->Test std::pmr containers on a pool\n");
+  unsigned int flags[] = { 0, BUDDY_NO_HEADER };
+  for (unsigned int f : flags)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = {};
+      opts.flags = f;
+      buddy_init_opts(&pool, 0, &opts);
+      buddy::memory_resource res(&pool);
+      {
+        std::pmr::vector<int> v(&res);
+        std::pmr::map<int, std::pmr::string> m(&res);
+        std::pmr::unordered_map<int, int> u(&res);
+        for (int i = 0; i < 10000; i++)
+          {
+            v.push_back(i);
+            m.emplace(i, std::pmr::string(40, 'x'));
+            u[i] = -i;
+          }
+        for (int i = 0; i < 10000; i += 2)
+          {
+            m.erase(i);
+            u.erase(i);
+          }
+        assert(v[9999] == 9999 && m.size() == 5000 && u.at(9999) == -9999);
+        assert(m.at(1) == std::pmr::string(40, 'x'));
+
+        //Over-aligned requests go through buddy_memalign
+        void *p = res.allocate(100, 256);
+        assert((uintptr_t)p % 256 == 0);
+        res.deallocate(p, 100, 256);
+      }
+      check_pool_full(&pool);
+
+      buddy::memory_resource same(&pool);
+      assert(res == same && res != *std::pmr::new_delete_resource());
+      bool threw = false;
+      try
+        {
+          (void)res.allocate((size_t)1 << 40);
+        }
+      catch (const std::bad_alloc &)
+        {
+          threw = true;
+        }
+      assert(threw);
+      buddy_destroy(&pool);
+    }
+}
+
+void test_buddy_allocator(void)
+{
+  fprintf(stderr, "->Test buddy::allocator\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, 0);
+  {
+    buddy::allocator<int> alloc(&pool);
+    std::vector<int, buddy::allocator<int>> v(alloc);
+    std::map<int, int, std::less<int>, buddy::allocator<std::pair<const int, int>>> m(alloc);
+    for (int i = 0; i < 10000; i++)
+      {
+        v.push_back(i);
+        m[i] = i * 2;
+      }
+    assert(v.back() == 9999 && m.at(9999) == 19998);
+    assert(v.get_allocator() == m.get_allocator());
+
+    struct alignas(128) line
+    {
+      char bytes[128];
+    };
+    buddy::allocator<line> lines(alloc);
+    line *l = lines.allocate(3);
+    assert((uintptr_t)l % 128 == 0);
+    lines.deallocate(l, 3);
+  }
+  check_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+void test_buddy_free_sized(void)
+{
+  fprintf(stderr, "->Test sized free\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = {};
+  opts.flags = BUDDY_NO_HEADER | BUDDY_SLAB;
+  buddy_init_opts(&pool, 0, &opts);
+  void *small = buddy_malloc(&pool, 20);
+  void *big = buddy_malloc(&pool, 100);
+  void *unknown = buddy_malloc(&pool, 1000);
+  //A size up to BUDDY_SLAB_MAX still looks for the slab
+  buddy_free_sized(&pool, small, 20);
+  buddy_free_sized(&pool, big, 100);
+  buddy_free_sized(&pool, unknown, 0);
+  buddy_free_sized(&pool, NULL, 8);
+  //The object went back to its slab, which stays cached
+  assert(buddy_malloc(&pool, 20) == small);
+  buddy_destroy(&pool);
+}
+
+int main(void) {
+  printf("Running C++ tests.\n");
+
+  UNITY_BEGIN();
+  RUN_TEST(test_buddy_memory_resource);
+  RUN_TEST(test_buddy_allocator);
+  RUN_TEST(test_buddy_free_sized);
+return UNITY_END();
+}
@@ -1,11 +1,17 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
 #include <errno.h>
 #endif
+#include <sys/mman.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include "harness/unity.h"
 #include "../src/lab.h"
 
@@ -43,6 +49,9 @@ void check_buddy_pool_full(struct buddy_pool *pool)
   //If this fails either buddy_init is wrong or we have corrupted the
   //buddy_pool struct.
   assert(pool->avail[pool->kval_m].next == pool->base);
+
+  //Only the top order should be marked as non-empty
+  assert(pool->avail_bits == (UINT64_C(1) << pool->kval_m));
 }
 
 /**
@@ -58,6 +67,63 @@ void check_buddy_pool_empty(struct buddy_pool *pool)
       assert(pool->avail[i].tag == BLOCK_UNUSED);
       assert(pool->avail[i].kval == i);
     }
+  assert(pool->avail_bits == 0);
+}
+
+/**
+ * Check that avail_bits has a bit set for exactly the non-empty avail lists,
+ * or the orders with free blocks in the side table.
+ */
+void check_buddy_pool_bits(struct buddy_pool *pool)
+{
+  for (size_t i = 0; i < MAX_K; i++)
+    {
+      bool nonempty = pool->avail[i].next != &pool->avail[i];
+      if (pool->flags & BUDDY_OUT_OF_LINE)
+        {
+          nonempty = pool->nfree[i] > 0;
+        }
+      bool bit = (pool->avail_bits >> i) & 1;
+      assert(nonempty == bit);
+    }
+}
+
+/**
+ * Check a pool using BUDDY_OUT_OF_LINE to ensure it is full. The intrusive
+ * lists are never used in this mode so they must stay empty.
+ */
+void check_buddy_pool_full_ool(struct buddy_pool *pool)
+{
+  for (size_t i = 0; i < MAX_K; i++)
+    {
+      assert(pool->avail[i].next == &pool->avail[i]);
+      assert(pool->nfree[i] == (i == pool->kval_m ? 1u : 0u));
+    }
+  assert(pool->avail_bits == (UINT64_C(1) << pool->kval_m));
+  assert(pool->free_map[pool->kval_m][0] == 1);
+  for (size_t i = SMALLEST_K; i < pool->kval_m; i++)
+    {
+      assert(pool->free_map[i][0] == 0);
+    }
+}
+
+/**
+ * Count how many pages of the pool are resident in memory.
+ */
+size_t count_resident_pages(struct buddy_pool *pool)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t pages = pool->numbytes / page;
+  unsigned char *vec = malloc(pages);
+  assert(vec != NULL);
+  assert(mincore(pool->base, pool->numbytes, vec) == 0);
+  size_t resident = 0;
+  for (size_t i = 0; i < pages; i++)
+    {
+      resident += vec[i] & 1;
+    }
+  free(vec);
+  return resident;
 }
 
 /**
@@ -162,9 +228,1478 @@ void test_buddy_alloc_free_two_blocks(void)
   fprintf(stderr, "->Two-block alloc/free test passed\n");
 }
 
+/**
+ * Allocate a run of differently sized blocks and make sure the order bitmap
+ * follows every split and coalesce.
+ */
+void test_buddy_avail_bits(void)
+{
+  fprintf(stderr, "->Test avail bitmap tracks the free lists\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+  void *mem[16];
+  for (int i = 0; i < 16; i++)
+    {
+      mem[i] = buddy_malloc(&pool, (size_t)1 << (i % 10));
+      assert(mem[i] != NULL);
+      check_buddy_pool_bits(&pool);
+    }
+  for (int i = 0; i < 16; i += 2)
+    {
+      buddy_free(&pool, mem[i]);
+      check_buddy_pool_bits(&pool);
+    }
+  for (int i = 1; i < 16; i += 2)
+    {
+      buddy_free(&pool, mem[i]);
+      check_buddy_pool_bits(&pool);
+    }
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Carve small blocks out of a large out of line pool. Only the pages that
+ * were handed out should be resident and everything must coalesce back.
+ */
+void test_buddy_out_of_line(void)
+{
+  fprintf(stderr, "->Test out of line metadata\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_OUT_OF_LINE };
+  buddy_init_opts(&pool, UINT64_C(1) << DEFAULT_K, &opts);
+  check_buddy_pool_full_ool(&pool);
+
+  void *mem = buddy_malloc(&pool, 1);
+  assert(mem != NULL);
+  assert(count_resident_pages(&pool) == 1);
+  assert(pool.avail_bits == ((UINT64_C(1) << DEFAULT_K) - (UINT64_C(1) << SMALLEST_K)));
+
+  void *more[32];
+  for (int i = 0; i < 32; i++)
+    {
+      more[i] = buddy_malloc(&pool, (size_t)1 << (i % 12));
+      assert(more[i] != NULL);
+    }
+  void *grown = buddy_realloc(&pool, more[0], 5000);
+  assert(grown != NULL);
+  more[0] = grown;
+  for (int i = 31; i >= 0; i--)
+    {
+      buddy_free(&pool, more[i]);
+    }
+  buddy_free(&pool, mem);
+  check_buddy_pool_full_ool(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Power of two requests from a header-free pool must use a block of exactly
+ * that size and come back through free and realloc.
+ */
+void test_buddy_no_header(void)
+{
+  fprintf(stderr, "->Test header-free allocations\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_NO_HEADER };
+  buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts);
+  assert(pool.flags & BUDDY_OUT_OF_LINE);
+
+  //Sixteen 64KiB requests fill a 1MiB pool exactly
+  char *mem[16];
+  for (int i = 0; i < 16; i++)
+    {
+      mem[i] = buddy_malloc(&pool, (size_t)1 << 16);
+      assert(mem[i] != NULL);
+      assert(((uintptr_t)mem[i] - (uintptr_t)pool.base) % ((size_t)1 << 16) == 0);
+      memset(mem[i], i, (size_t)1 << 16);
+    }
+  assert(pool.avail_bits == 0);
+  assert(buddy_malloc(&pool, 1) == NULL);
+
+  //Free two buddies and grow one of the others into the hole
+  buddy_free(&pool, mem[0]);
+  buddy_free(&pool, mem[1]);
+  char *grown = buddy_realloc(&pool, mem[2], (size_t)1 << 17);
+  assert(grown != NULL);
+  for (size_t i = 0; i < ((size_t)1 << 16); i++)
+    {
+      assert(grown[i] == 2);
+    }
+  mem[0] = grown;
+  mem[1] = NULL;
+  mem[2] = NULL;
+  for (int i = 0; i < 16; i++)
+    {
+      buddy_free(&pool, mem[i]);
+    }
+  check_buddy_pool_full_ool(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Worker for test_buddy_thread_cache. Keeps a window of live blocks filled
+ * with a per thread pattern and checks the pattern before freeing them.
+ */
+static void *thread_cache_worker(void *arg)
+{
+  struct buddy_pool *pool = arg;
+  unsigned int seed = (unsigned int)(uintptr_t)pthread_self();
+  unsigned char *live[64] = {0};
+  size_t sizes[64] = {0};
+  unsigned char pattern = (unsigned char)(seed & 0xff);
+  for (int i = 0; i < 20000; i++)
+    {
+      int slot = rand_r(&seed) % 64;
+      if (live[slot])
+        {
+          for (size_t j = 0; j < sizes[slot]; j++)
+            {
+              assert(live[slot][j] == pattern);
+            }
+          buddy_free(pool, live[slot]);
+        }
+      sizes[slot] = 1 + (size_t)(rand_r(&seed) % 2000);
+      live[slot] = buddy_malloc(pool, sizes[slot]);
+      assert(live[slot] != NULL);
+      memset(live[slot], pattern, sizes[slot]);
+    }
+  for (int i = 0; i < 64; i++)
+    {
+      buddy_free(pool, live[i]);
+    }
+  return NULL;
+}
+
+/**
+ * Hammer a thread safe pool with per thread caches from several threads.
+ * Once the threads have exited their caches must be back in the pool.
+ */
+void test_buddy_thread_cache(void)
+{
+  fprintf(stderr, "->Test thread safe pool with per thread caches\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .tcache_orders = 4 };
+  buddy_init_opts(&pool, UINT64_C(1) << 24, &opts);
+  assert(pool.flags & BUDDY_THREAD_SAFE);
+
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++)
+    {
+      assert(pthread_create(&threads[i], NULL, thread_cache_worker, &pool) == 0);
+    }
+  for (int i = 0; i < 4; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+
+  //The main thread goes through its cache too
+  void *mem = buddy_malloc(&pool, 100);
+  assert(mem != NULL);
+  buddy_free(&pool, mem);
+  buddy_flush_cache(&pool);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Split a pool into arenas and run the threaded workload against it. Every
+ * block must go back to the arena that owns its address.
+ */
+void test_buddy_arenas(void)
+{
+  fprintf(stderr, "->Test per CPU arenas\n");
+  struct buddy_options configs[] = {
+    { .arenas = 4 },
+    { .arenas = 4, .tcache_orders = 2, .flags = BUDDY_NO_HEADER },
+  };
+  for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++)
+    {
+      struct buddy_pool pool;
+      buddy_init_opts(&pool, UINT64_C(1) << 24, &configs[c]);
+      assert(pool.narenas == 4);
+      assert(pool.arena_k == 22);
+      assert(pool.avail_bits == 0);
+
+      pthread_t threads[4];
+      for (int i = 0; i < 4; i++)
+        {
+          assert(pthread_create(&threads[i], NULL, thread_cache_worker, &pool) == 0);
+        }
+      for (int i = 0; i < 4; i++)
+        {
+          pthread_join(threads[i], NULL);
+        }
+
+      //A request bigger than one arena can never be satisfied
+      assert(buddy_malloc(&pool, ((size_t)1 << 22) + 1) == NULL);
+      void *mem = buddy_malloc(&pool, ((size_t)1 << 22) - sizeof(struct avail));
+      assert(mem != NULL);
+      buddy_free(&pool, mem);
+      buddy_flush_cache(&pool);
+
+      for (size_t i = 0; i < pool.narenas; i++)
+        {
+          struct buddy_pool *arena = &pool.arena[i];
+          assert(arena->base == (char *)pool.base + (i << pool.arena_k));
+          if (arena->flags & BUDDY_OUT_OF_LINE)
+            {
+              check_buddy_pool_full_ool(arena);
+            }
+          else
+            {
+              check_buddy_pool_full(arena);
+            }
+        }
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Run the threaded workload against a lock free pool. Some merges may still
+ * be pending afterwards, asking for the whole pool must finish them.
+ */
+void test_buddy_lock_free(void)
+{
+  fprintf(stderr, "->Test lock free pool\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_LOCK_FREE | BUDDY_NO_HEADER, .arenas = 4 };
+  buddy_init_opts(&pool, UINT64_C(1) << 24, &opts);
+  assert(pool.flags == BUDDY_LOCK_FREE);
+  assert(pool.narenas == 0);
+  assert(pool.lf_head[24] != 0);
+
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++)
+    {
+      assert(pthread_create(&threads[i], NULL, thread_cache_worker, &pool) == 0);
+    }
+  for (int i = 0; i < 4; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+
+  void *all = buddy_malloc(&pool, (UINT64_C(1) << 24) - sizeof(struct avail));
+  assert(all == (struct avail *)pool.base + 1);
+  //Every stack is empty, the top slot lives in the low 42 bits of a head
+  for (size_t i = 0; i < MAX_K; i++)
+    {
+      assert((pool.lf_head[i] & ((UINT64_C(1) << 42) - 1)) == 0);
+    }
+  buddy_free(&pool, all);
+  assert(((struct avail *)pool.base)->tag == BLOCK_AVAIL);
+  assert(((struct avail *)pool.base)->kval == 24);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Fill slabs of every size class, make sure the objects do not overlap and
+ * that the slabs go back to the pool once they are empty.
+ */
+void test_buddy_slab(void)
+{
+  fprintf(stderr, "->Test slab allocations\n");
+  unsigned int flags[] = { BUDDY_SLAB, BUDDY_SLAB | BUDDY_NO_HEADER };
+  for (size_t f = 0; f < 2; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f] };
+      buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts);
+
+      //2000 objects of each size, 256000 bytes of payload in total
+      static unsigned char *obj[5][2000];
+      size_t sizes[5] = { 5, 16, 20, 32, 48 };
+      for (int c = 0; c < 5; c++)
+        {
+          for (int i = 0; i < 2000; i++)
+            {
+              obj[c][i] = buddy_malloc(&pool, sizes[c]);
+              assert(obj[c][i] != NULL);
+              assert(((uintptr_t)obj[c][i] & 7) == 0);
+              memset(obj[c][i], c * 16 + (i & 15), sizes[c]);
+            }
+        }
+      size_t free_bytes = 0;
+      for (size_t k = 0; k < MAX_K; k++)
+        {
+          free_bytes += pool.nfree[k] << k;
+        }
+      assert(pool.numbytes - free_bytes < 300000);
+
+      //A regular block still works next to the slabs
+      void *big = buddy_malloc(&pool, 1000);
+      assert(big != NULL);
+      memset(big, 0xff, 1000);
+
+      //Grow one object out of its slab
+      unsigned char *grown = buddy_realloc(&pool, obj[4][7], 200);
+      assert(grown != NULL);
+      for (int j = 0; j < 48; j++)
+        {
+          assert(grown[j] == 4 * 16 + 7);
+        }
+      obj[4][7] = grown;
+
+      for (int c = 0; c < 5; c++)
+        {
+          for (int i = 0; i < 2000; i++)
+            {
+              size_t n = c == 4 && i == 7 ? 48 : sizes[c];
+              for (size_t j = 0; j < n; j++)
+                {
+                  assert(obj[c][i][j] == c * 16 + (i & 15));
+                }
+              buddy_free(&pool, obj[c][i]);
+            }
+        }
+      buddy_free(&pool, big);
+
+      //Each class keeps its last slab around
+      for (int c = 0; c < 5; c++)
+        {
+          assert(pool.slab_partial[c] != NULL);
+          void *mem = buddy_malloc(&pool, sizes[c]);
+          assert(mem != NULL);
+          buddy_free(&pool, mem);
+        }
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Allocate batches and make sure the blocks are distinct, do not overlap and
+ * that a batch larger than the pool returns what fits.
+ */
+void test_buddy_malloc_batch(void)
+{
+  fprintf(stderr, "->Test batch allocation\n");
+  unsigned int flags[] = { 0, BUDDY_NO_HEADER };
+  for (size_t f = 0; f < 2; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f] };
+      buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts);
+      void *hole = buddy_malloc(&pool, 3000);
+      assert(hole != NULL);
+
+      static char *out[1024];
+      size_t n = buddy_malloc_batch(&pool, 1000, 100, (void **)out);
+      assert(n == 100);
+      for (size_t i = 0; i < n; i++)
+        {
+          memset(out[i], (int)i, 1000);
+        }
+      for (size_t i = 0; i < n; i++)
+        {
+          for (size_t j = 0; j < 1000; j++)
+            {
+              assert(out[i][j] == (char)i);
+            }
+        }
+      check_buddy_pool_bits(&pool);
+
+      //Ask for more than the pool holds
+      errno = 0;
+      size_t more = buddy_malloc_batch(&pool, 1000, 1024, (void **)out + n);
+      assert(more < 1024 - n);
+      assert(errno == ENOMEM);
+      assert(buddy_malloc(&pool, 1000) == NULL);
+
+      for (size_t i = 0; i < n + more; i++)
+        {
+          buddy_free(&pool, out[i]);
+        }
+      buddy_free(&pool, hole);
+      if (pool.flags & BUDDY_OUT_OF_LINE)
+        {
+          check_buddy_pool_full_ool(&pool);
+        }
+      else
+        {
+          check_buddy_pool_full(&pool);
+        }
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Free a large batch of sibling blocks in random order together with blocks
+ * of other sizes and make sure the pool coalesces completely.
+ */
+void test_buddy_free_batch(void)
+{
+  fprintf(stderr, "->Test batch free\n");
+  unsigned int flags[] = { 0, BUDDY_NO_HEADER, BUDDY_NO_HEADER | BUDDY_SLAB };
+  for (size_t f = 0; f < 3; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f] };
+      buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts);
+
+      static void *ptrs[4200];
+      size_t n = buddy_malloc_batch(&pool, 100, 4096, ptrs);
+      assert(n == 4096);
+      for (size_t i = 0; i < 100; i++)
+        {
+          ptrs[n++] = buddy_malloc(&pool, 1 + (size_t)rand() % 3000);
+          assert(ptrs[n - 1] != NULL);
+        }
+      ptrs[n++] = NULL;
+      for (size_t i = n - 1; i > 0; i--)
+        {
+          size_t j = (size_t)rand() % (i + 1);
+          void *tmp = ptrs[i];
+          ptrs[i] = ptrs[j];
+          ptrs[j] = tmp;
+        }
+
+      buddy_free_batch(&pool, ptrs, n);
+      if (pool.flags & BUDDY_SLAB)
+        {
+          //Only the slabs that stay cached are missing
+          buddy_destroy(&pool);
+          continue;
+        }
+      if (pool.flags & BUDDY_OUT_OF_LINE)
+        {
+          check_buddy_pool_full_ool(&pool);
+        }
+      else
+        {
+          check_buddy_pool_full(&pool);
+        }
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Grow a buffer by doubling and make sure it stays put while its upper
+ * buddies are free and moves once they are not.
+ */
+void test_buddy_realloc_grow(void)
+{
+  fprintf(stderr, "->Test realloc growing in place\n");
+  unsigned int flags[] = { 0, BUDDY_NO_HEADER };
+  for (size_t f = 0; f < 2; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f] };
+      buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts);
+      size_t hdr = (pool.flags & BUDDY_NO_HEADER) ? 0 : sizeof(struct avail);
+
+      char *buf = buddy_malloc(&pool, 64 - hdr);
+      assert(buf != NULL);
+      memset(buf, 0x5a, 64 - hdr);
+      for (size_t size = 128; size <= (1 << 16); size *= 2)
+        {
+          char *grown = buddy_realloc(&pool, buf, size - hdr);
+          assert(grown == buf);
+          assert(grown[0] == 0x5a);
+          memset(grown, 0x5a, size - hdr);
+        }
+
+      //The upper buddy is taken so the next doubling has to move
+      void *blocker = buddy_malloc(&pool, (1 << 16) - hdr);
+      assert(blocker == buf + (1 << 16));
+      char *moved = buddy_realloc(&pool, buf, (1 << 17) - hdr);
+      assert(moved != NULL && moved != buf);
+      assert(moved[(1 << 16) - hdr - 1] == 0x5a);
+
+      buddy_free(&pool, blocker);
+      buddy_free(&pool, moved);
+      if (pool.flags & BUDDY_OUT_OF_LINE)
+        {
+          check_buddy_pool_full_ool(&pool);
+        }
+      else
+        {
+          check_buddy_pool_full(&pool);
+        }
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Shrink a big buffer and make sure the tail is free again, and that the
+ * slack option keeps blocks that are only a little too big.
+ */
+void test_buddy_realloc_shrink(void)
+{
+  fprintf(stderr, "->Test realloc shrinking in place\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, UINT64_C(1) << MIN_K);
+
+  char *buf = buddy_malloc(&pool, (1 << 20) - sizeof(struct avail));
+  assert(buf != NULL);
+  memset(buf, 0x5a, 1 << 12);
+  char *small = buddy_realloc(&pool, buf, 1000);
+  assert(small == buf);
+  assert(small[999] == 0x5a);
+  assert(((struct avail *)small - 1)->kval == 10);
+
+  //The freed tail is usable right away
+  void *next = buddy_malloc(&pool, (1 << 19) - sizeof(struct avail));
+  assert(next == buf + (1 << 19));
+  buddy_free(&pool, next);
+  buddy_free(&pool, small);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+
+  struct buddy_options opts = { .flags = BUDDY_NO_HEADER, .shrink_slack = 2 };
+  buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts);
+  buf = buddy_malloc(&pool, 1 << 16);
+  assert(buddy_realloc(&pool, buf, 1 << 14) == buf);
+  assert(pool.order_map[0] == 16);
+  assert(buddy_realloc(&pool, buf, 1 << 13) == buf);
+  assert(pool.order_map[0] == 13);
+  buddy_free(&pool, buf);
+  check_buddy_pool_full_ool(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Aligned allocations of several sizes and alignments in every header mode,
+ * including realloc and free of the aligned pointers.
+ */
+void test_buddy_memalign(void)
+{
+  fprintf(stderr, "->Test aligned allocations\n");
+  unsigned int flags[] = { 0, BUDDY_NO_HEADER, BUDDY_NO_HEADER | BUDDY_SLAB };
+  size_t aligns[] = { 8, 16, 64, 4096, 1 << 21 };
+  size_t sizes[] = { 1, 40, 100, 5000, 1 << 20 };
+  for (size_t f = 0; f < 3; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f] };
+      buddy_init_opts(&pool, UINT64_C(1) << 26, &opts);
+      assert(((uintptr_t)pool.base & ((1 << 26) - 1)) == 0);
+
+      void *mem[25];
+      for (size_t a = 0; a < 5; a++)
+        {
+          for (size_t s = 0; s < 5; s++)
+            {
+              char *p = buddy_memalign(&pool, aligns[a], sizes[s]);
+              assert(p != NULL);
+              assert(((uintptr_t)p & (aligns[a] - 1)) == 0);
+              memset(p, 0x33, sizes[s]);
+              mem[a * 5 + s] = p;
+            }
+        }
+
+      //No waste without headers: a 64 byte request aligned to 4KiB
+      //leaves the rest of its 4KiB block free
+      if (pool.flags & BUDDY_NO_HEADER)
+        {
+          assert(pool.order_map[((char *)mem[15] - (char *)pool.base) >> SMALLEST_K] == SMALLEST_K);
+        }
+
+      char *grown = buddy_realloc(&pool, mem[13], 20000);
+      assert(grown != NULL && grown[4999] == 0x33);
+      mem[13] = grown;
+      for (size_t i = 0; i < 25; i++)
+        {
+          buddy_free(&pool, mem[i]);
+        }
+      if (!(pool.flags & BUDDY_SLAB))
+        {
+          if (pool.flags & BUDDY_OUT_OF_LINE)
+            {
+              check_buddy_pool_full_ool(&pool);
+            }
+          else
+            {
+              check_buddy_pool_full(&pool);
+            }
+        }
+
+      errno = 0;
+      assert(buddy_memalign(&pool, 48, 10) == NULL && errno == EINVAL);
+      assert(buddy_aligned_alloc(&pool, (size_t)1 << 27, 10) == NULL && errno == ENOMEM);
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Slab objects whose neighbours hold the BLOCK_ALIGNED tag must not be
+ * mistaken for buddy_memalign pointers in a pool with headers.
+ */
+void test_buddy_slab_aligned_tag(void)
+{
+  fprintf(stderr, "->Test slab objects next to an aligned tag\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_SLAB, .arenas = 4 };
+  buddy_init_opts(&pool, UINT64_C(1) << 22, &opts);
+
+  //Every object starts like a shim header with a garbage next pointer
+  static unsigned short *obj[2][1000];
+  static void *aligned[1000];
+  size_t sizes[2] = { 8, 24 };
+  for (int i = 0; i < 1000; i++)
+    {
+      for (int c = 0; c < 2; c++)
+        {
+          obj[c][i] = buddy_malloc(&pool, sizes[c]);
+          assert(obj[c][i] != NULL);
+          obj[c][i][0] = BLOCK_ALIGNED;
+          obj[c][i][1] = 0;
+          obj[c][i][2] = 0xbeef;
+          obj[c][i][3] = 0xdead;
+        }
+      aligned[i] = buddy_memalign(&pool, 64, 100);
+      assert(aligned[i] != NULL && ((uintptr_t)aligned[i] & 63) == 0);
+      memset(aligned[i], BLOCK_ALIGNED, 100);
+    }
+
+  for (int i = 0; i < 1000; i++)
+    {
+      for (int c = 0; c < 2; c++)
+        {
+          assert(buddy_usable_size(&pool, obj[c][i]) == sizes[c]);
+        }
+      assert(buddy_usable_size(&pool, aligned[i]) >= 100);
+    }
+  //Half go through the batch path, the rest one at a time
+  buddy_free_batch(&pool, (void **)obj[0], 1000);
+  for (int i = 0; i < 1000; i++)
+    {
+      obj[1][i] = buddy_realloc(&pool, obj[1][i], 16);
+      assert(obj[1][i][0] == BLOCK_ALIGNED && obj[1][i][3] == 0xdead);
+      buddy_free(&pool, obj[1][i]);
+      buddy_free(&pool, aligned[i]);
+    }
+  buddy_destroy(&pool);
+}
+
+/**
+ * buddy_calloc must hand out zeroed memory, and with BUDDY_TRACK_ZERO it
+ * must not touch the pages of a fresh pool to do so.
+ */
+void test_buddy_calloc(void)
+{
+  fprintf(stderr, "->Test calloc\n");
+  unsigned int flags[] = { 0, BUDDY_TRACK_ZERO, BUDDY_TRACK_ZERO | BUDDY_NO_HEADER,
+                           BUDDY_TRACK_ZERO | BUDDY_NO_HEADER | BUDDY_SLAB };
+  for (size_t f = 0; f < 4; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f], .arenas = f == 3 ? 4 : 0 };
+      buddy_init_opts(&pool, UINT64_C(1) << 24, &opts);
+
+      size_t n = (1 << 22) / sizeof(uint64_t);
+      uint64_t *table = buddy_calloc(&pool, n, sizeof(uint64_t));
+      assert(table != NULL);
+      if (pool.flags & BUDDY_TRACK_ZERO)
+        {
+          //At most the block header and the header of its free buddy
+          //were written
+          assert(count_resident_pages(&pool) <= 2);
+        }
+      for (size_t i = 0; i < n; i++)
+        {
+          assert(table[i] == 0);
+        }
+
+      //Dirty the memory with small and large blocks and do it again
+      memset(table, 0xff, n * sizeof(uint64_t));
+      buddy_free(&pool, table);
+      void *small[64];
+      for (size_t i = 0; i < 64; i++)
+        {
+          small[i] = buddy_malloc(&pool, 1 + i * 37);
+          memset(small[i], 0xee, 1 + i * 37);
+        }
+      for (size_t i = 0; i < 64; i += 2)
+        {
+          buddy_free(&pool, small[i]);
+        }
+      for (size_t i = 0; i < 64; i += 2)
+        {
+          unsigned char *z = buddy_calloc(&pool, i + 1, 37);
+          assert(z != NULL);
+          for (size_t j = 0; j < (i + 1) * 37; j++)
+            {
+              assert(z[j] == 0);
+            }
+          small[i] = z;
+        }
+      table = buddy_calloc(&pool, n, sizeof(uint64_t));
+      assert(table != NULL);
+      for (size_t i = 0; i < n; i++)
+        {
+          assert(table[i] == 0);
+        }
+      buddy_free(&pool, table);
+      for (size_t i = 0; i < 64; i++)
+        {
+          buddy_free(&pool, small[i]);
+        }
+
+      errno = 0;
+      assert(buddy_calloc(&pool, SIZE_MAX / 2, 4) == NULL && errno == ENOMEM);
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Requests above the mmap threshold live outside the pool and move between
+ * the pool and their own mapping as realloc crosses the threshold.
+ */
+void test_buddy_mmap_threshold(void)
+{
+  fprintf(stderr, "->Test mmap threshold\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_NO_HEADER, .mmap_threshold = 1 << 18 };
+  buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts);
+
+  //Bigger than the whole pool
+  char *big = buddy_malloc(&pool, 4 << 20);
+  assert(big != NULL);
+  assert(big < (char *)pool.base || big >= (char *)pool.base + pool.numbytes);
+  check_buddy_pool_full_ool(&pool);
+  memset(big, 0x42, 4 << 20);
+
+  char *bigger = buddy_realloc(&pool, big, 64 << 20);
+  assert(bigger != NULL);
+  assert(bigger[(4 << 20) - 1] == 0x42);
+  bigger[(64 << 20) - 1] = 1;
+
+  //Below the threshold the data moves into the pool
+  char *small = buddy_realloc(&pool, bigger, 1000);
+  assert(small >= (char *)pool.base && small < (char *)pool.base + pool.numbytes);
+  assert(small[999] == 0x42);
+  char *again = buddy_realloc(&pool, small, 1 << 18);
+  assert(again < (char *)pool.base || again >= (char *)pool.base + pool.numbytes);
+  assert(again[999] == 0x42);
+  check_buddy_pool_full_ool(&pool);
+
+  unsigned char *zero = buddy_calloc(&pool, 1 << 10, 1 << 10);
+  assert(zero != NULL && zero[12345] == 0);
+  void *ptrs[3] = { again, buddy_malloc(&pool, 100), zero };
+  buddy_free_batch(&pool, ptrs, 3);
+  assert(pool.big == NULL);
+  check_buddy_pool_full_ool(&pool);
+
+  //Whatever is still mapped goes away with the pool
+  assert(buddy_malloc(&pool, 1 << 20) != NULL);
+  buddy_destroy(&pool);
+  assert(pool.big == NULL);
+}
+
+/**
+ * Count the regions of a growable pool that are currently mapped.
+ */
+static size_t mapped_regions(struct buddy_pool *pool)
+{
+  size_t n = 0;
+  for (size_t i = 0; i < pool->nregions; i++)
+    {
+      n += pool->region[i].numbytes != 0;
+    }
+  return n;
+}
+
+/**
+ * A growable pool adds regions when it runs out, gives them back once they
+ * are free again and stops at max_regions.
+ */
+void test_buddy_regions(void)
+{
+  fprintf(stderr, "->Test growable pools\n");
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_NO_HEADER, .max_regions = 3 };
+  buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &opts);
+
+  char *mem[4];
+  for (int i = 0; i < 4; i++)
+    {
+      mem[i] = buddy_malloc(&pool, 1 << MIN_K);
+      assert(mem[i] != NULL);
+      memset(mem[i], i, 1 << MIN_K);
+    }
+  assert(mapped_regions(&pool) == 3);
+  errno = 0;
+  assert(buddy_malloc(&pool, 64) == NULL && errno == ENOMEM);
+
+  char *grown = buddy_realloc(&pool, mem[3], 100);
+  assert(grown == mem[3] && grown[99] == 3);
+  //The first region to become empty is kept as a spare
+  buddy_free(&pool, mem[1]);
+  assert(mapped_regions(&pool) == 3);
+  buddy_free(&pool, mem[2]);
+  assert(mapped_regions(&pool) == 2);
+  assert(buddy_trim(&pool) == (1 << MIN_K));
+  assert(mapped_regions(&pool) == 1);
+
+  //Released slots are reused
+  void *again = buddy_malloc(&pool, 1 << MIN_K);
+  assert(again != NULL);
+  assert(mapped_regions(&pool) == 2);
+  buddy_free(&pool, again);
+  buddy_free(&pool, grown);
+  buddy_free(&pool, mem[0]);
+  check_buddy_pool_full_ool(&pool);
+  buddy_destroy(&pool);
+
+  //An empty slab in a region does not keep the region alive
+  struct buddy_options slabs = { .flags = BUDDY_NO_HEADER | BUDDY_SLAB, .max_regions = 2 };
+  buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &slabs);
+  void *whole = buddy_malloc(&pool, 1 << MIN_K);
+  void *obj = buddy_malloc(&pool, 16);
+  assert(whole != NULL && obj != NULL && mapped_regions(&pool) == 1);
+  buddy_free(&pool, obj);
+  assert(buddy_trim(&pool) == (1 << MIN_K));
+  assert(mapped_regions(&pool) == 0);
+  buddy_free(&pool, whole);
+  check_buddy_pool_full_ool(&pool);
+  buddy_destroy(&pool);
+
+  //Every region is found by its address, also once the slots were reused
+  struct buddy_options many = { .flags = BUDDY_NO_HEADER, .max_regions = BUDDY_REGIONS_MAX };
+  buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &many);
+  static char *blocks[BUDDY_REGIONS_MAX + 1];
+  for (int round = 0; round < 3; round++)
+    {
+      for (size_t i = 0; i <= BUDDY_REGIONS_MAX; i++)
+        {
+          blocks[i] = buddy_malloc(&pool, 1 << MIN_K);
+          assert(blocks[i] != NULL);
+          assert(buddy_owns(&pool, blocks[i]) && buddy_owns(&pool, blocks[i] + (1 << MIN_K) - 1));
+        }
+      assert(mapped_regions(&pool) == BUDDY_REGIONS_MAX);
+      for (size_t i = 0; i <= BUDDY_REGIONS_MAX; i++)
+        {
+          buddy_free(&pool, blocks[i]);
+        }
+      buddy_trim(&pool);
+      assert(mapped_regions(&pool) == 0);
+      assert(!buddy_owns(&pool, blocks[BUDDY_REGIONS_MAX]));
+    }
+  check_buddy_pool_full_ool(&pool);
+  buddy_destroy(&pool);
+
+  //Threads grow and shrink a small pool concurrently
+  struct buddy_options shared = { .flags = BUDDY_THREAD_SAFE, .max_regions = 16 };
+  buddy_init_opts(&pool, UINT64_C(1) << MIN_K, &shared);
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++)
+    {
+      assert(pthread_create(&threads[i], NULL, thread_cache_worker, &pool) == 0);
+    }
+  for (int i = 0; i < 4; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+  assert(mapped_regions(&pool) <= 1);
+  buddy_trim(&pool);
+  assert(mapped_regions(&pool) == 0);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * A batch of blocks from several arenas and regions must only merge
+ * buddies within one tree.
+ */
+void test_buddy_free_batch_trees(void)
+{
+  fprintf(stderr, "->Test batch free across arenas and regions\n");
+  unsigned int flags[] = { 0, BUDDY_NO_HEADER };
+  for (size_t f = 0; f < 2; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f], .arenas = 4, .max_regions = 4,
+                                    .tcache_orders = 2 };
+      buddy_init_opts(&pool, UINT64_C(1) << (MIN_K + 2), &opts);
+
+      //Twice the pool in 4KiB blocks spills into regions
+      static void *ptrs[2048];
+      for (size_t i = 0; i < 2048; i++)
+        {
+          ptrs[i] = buddy_malloc(&pool, 4000);
+          assert(ptrs[i] != NULL);
+        }
+      assert(mapped_regions(&pool) >= 1);
+      //Blocks left out keep every tree from merging all the way up, so
+      //the last block of one tree meets the first of the next
+      static void *rest[2048];
+      size_t n = 0, left = 0;
+      for (size_t i = 0; i < 2048; i++)
+        {
+          if (rand() % 4 == 0)
+            {
+              rest[left++] = ptrs[i];
+            }
+          else
+            {
+              ptrs[n++] = ptrs[i];
+            }
+        }
+      buddy_free_batch(&pool, ptrs, n);
+      buddy_free_batch(&pool, rest, left);
+      buddy_flush_cache(&pool);
+      buddy_trim(&pool);
+      assert(mapped_regions(&pool) == 0);
+      for (size_t a = 0; a < pool.narenas; a++)
+        {
+          assert(pool.arena[a].nfree[pool.arena[a].kval_m] == 1);
+        }
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Freed blocks above purge_order give their pages back to the system and
+ * the counters see both the purge and the pages coming back.
+ */
+void test_buddy_purge(void)
+{
+  fprintf(stderr, "->Test purging free blocks\n");
+  unsigned int flags[] = { BUDDY_NO_HEADER | BUDDY_TRACK_ZERO, 0, BUDDY_PURGE_LAZY };
+  for (size_t f = 0; f < 3; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f], .purge_order = 16 };
+      buddy_init_opts(&pool, UINT64_C(1) << 24, &opts);
+
+      char *big = buddy_malloc(&pool, (4 << 20) - 4096);
+      char *small = buddy_malloc(&pool, 1000);
+      assert(big != NULL && small != NULL);
+      memset(big, 1, (4 << 20) - 4096);
+      memset(small, 1, 1000);
+      assert(count_resident_pages(&pool) >= 1000);
+
+      buddy_free(&pool, big);
+      struct buddy_stats st;
+      buddy_stats(&pool, &st);
+      assert(st.purged_bytes >= (4 << 20) - 4096);
+      assert(st.reused_purged_pages == 0);
+      if (!(pool.flags & BUDDY_PURGE_LAZY))
+        {
+          //What is left are the small block and, with headers, one
+          //header page per free block
+          assert(count_resident_pages(&pool) <= 16);
+        }
+
+      //Only the new half is purged once the small block merges too
+      buddy_free(&pool, small);
+      buddy_stats(&pool, &st);
+      assert(st.purged_bytes <= (16 << 20));
+
+      if (pool.flags & BUDDY_TRACK_ZERO)
+        {
+          //Purged pages are zero again so calloc leaves them alone
+          unsigned char *z = buddy_calloc(&pool, 1, 4 << 20);
+          assert(z != NULL);
+          assert(count_resident_pages(&pool) <= 2);
+          assert(z[12345] == 0);
+          buddy_free(&pool, z);
+        }
+
+      void *again = buddy_malloc(&pool, 1 << 20);
+      buddy_stats(&pool, &st);
+      assert(st.reused_purged_pages >= 255);
+      buddy_free(&pool, again);
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * With a decay window freed memory is purged only after it stayed free for
+ * the whole window, memory reused within it keeps its pages.
+ */
+void test_buddy_purge_decay(void)
+{
+  fprintf(stderr, "->Test purging free blocks after a decay window\n");
+  unsigned int flags[] = { BUDDY_NO_HEADER, 0 };
+  for (size_t f = 0; f < 2; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f], .purge_order = 16, .purge_decay_ms = 200 };
+      buddy_init_opts(&pool, UINT64_C(1) << 24, &opts);
+      assert(pool.flags & BUDDY_THREAD_SAFE);
+
+      //Memory freed and reused within the window is never purged
+      char *big = buddy_malloc(&pool, (4 << 20) - 4096);
+      assert(big != NULL);
+      memset(big, 1, (4 << 20) - 4096);
+      buddy_free(&pool, big);
+      big = buddy_malloc(&pool, (4 << 20) - 4096);
+      memset(big, 2, (4 << 20) - 4096);
+      struct buddy_stats st;
+      buddy_stats(&pool, &st);
+      assert(st.purged_bytes == 0);
+      assert(st.reused_purged_pages == 0);
+      assert(count_resident_pages(&pool) >= 1000);
+
+      //Once it stays free the thread purges it
+      buddy_free(&pool, big);
+      for (int i = 0; i < 100 && st.purged_bytes < (size_t)(4 << 20) - 4096; i++)
+        {
+          usleep(20000);
+          buddy_stats(&pool, &st);
+        }
+      assert(st.purged_bytes >= (4 << 20) - 4096);
+      assert(count_resident_pages(&pool) <= 16);
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Pools backed by hugetlb pages or THP keep only the backing the system
+ * could give, stay aligned to a huge page and fall back to BUDDY_HUGE_K for
+ * page orders they can not use.
+ */
+void test_buddy_huge_pages(void)
+{
+  fprintf(stderr, "->Test huge page backing and its fallback\n");
+  unsigned int flags[] = { BUDDY_HUGETLB, BUDDY_THP, BUDDY_HUGETLB | BUDDY_THP | BUDDY_NO_HEADER };
+  for (size_t f = 0; f < 3; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f], .purge_order = 16 };
+      buddy_init_opts(&pool, 0, &opts);
+      //Only what the system could give is left in the flags
+      unsigned int got = pool.flags & (BUDDY_HUGETLB | BUDDY_THP);
+      assert((got & ~flags[f]) == 0);
+      assert(got != (BUDDY_HUGETLB | BUDDY_THP));
+      assert(((uintptr_t)pool.base & ((UINT64_C(1) << 21) - 1)) == 0);
+      assert(pool.purge_order == ((pool.flags & BUDDY_HUGETLB) ? 0 : 16));
+
+      char *a = buddy_malloc(&pool, 3 << 20);
+      char *b = buddy_malloc(&pool, 100);
+      assert(a != NULL && b != NULL);
+      memset(a, 1, 3 << 20);
+      memset(b, 2, 100);
+      buddy_free(&pool, a);
+      buddy_free(&pool, b);
+      if (pool.flags & BUDDY_NO_HEADER)
+        {
+          check_buddy_pool_full_ool(&pool);
+        }
+      else
+        {
+          check_buddy_pool_full(&pool);
+        }
+      buddy_destroy(&pool);
+    }
+
+  //A small pool is still aligned to a whole huge page for THP
+  struct buddy_pool pool;
+  struct buddy_options opts = { .flags = BUDDY_THP };
+  buddy_init_opts(&pool, 1 << MIN_K, &opts);
+  assert(((uintptr_t)pool.base & ((UINT64_C(1) << 21) - 1)) == 0);
+  void *p = buddy_malloc(&pool, 1000);
+  assert(p != NULL);
+  buddy_free(&pool, p);
+  buddy_destroy(&pool);
+
+  //Page orders the pool can not use fall back to the default
+  size_t bad_k[] = { 3, MIN_K + 5 };
+  for (size_t i = 0; i < 2; i++)
+    {
+      struct buddy_options bad = { .flags = BUDDY_HUGETLB | BUDDY_THP, .huge_page_k = bad_k[i] };
+      buddy_init_opts(&pool, 1 << MIN_K, &bad);
+      assert(pool.huge_k == BUDDY_HUGE_K);
+      p = buddy_malloc(&pool, 1000);
+      assert(p != NULL);
+      buddy_free(&pool, p);
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Prefaulted pools are resident from the start and stay so across frees,
+ * locked pools as well when the memory lock limit allows it.
+ */
+void test_buddy_prefault(void)
+{
+  fprintf(stderr, "->Test prefaulted and locked pools\n");
+  unsigned int flags[] = { BUDDY_PREFAULT, BUDDY_PREFAULT | BUDDY_NO_HEADER, BUDDY_MLOCK };
+  for (size_t f = 0; f < 3; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f], .purge_order = 16 };
+      buddy_init_opts(&pool, UINT64_C(1) << 24, &opts);
+      size_t pages = pool.numbytes >> 12;
+      if (flags[f] & BUDDY_MLOCK)
+        {
+          //Only root or a generous RLIMIT_MEMLOCK can lock 16MiB
+          if (!(pool.flags & BUDDY_MLOCK))
+            {
+              assert(count_resident_pages(&pool) < pages);
+              buddy_destroy(&pool);
+              continue;
+            }
+          assert(pool.purge_order == 0);
+        }
+      assert(count_resident_pages(&pool) == pages);
+
+      //Freed memory stays resident, so it is ready for the next request
+      char *p = buddy_malloc(&pool, 4 << 20);
+      assert(p != NULL);
+      memset(p, 1, 4 << 20);
+      buddy_free(&pool, p);
+      if (pool.flags & BUDDY_MLOCK)
+        {
+          assert(count_resident_pages(&pool) == pages);
+        }
+      if (pool.flags & BUDDY_NO_HEADER)
+        {
+          check_buddy_pool_full_ool(&pool);
+        }
+      else
+        {
+          check_buddy_pool_full(&pool);
+        }
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Prefault pools with several threads, one thread per CPU over several
+ * arenas, more arenas than there are CPUs and more threads than
+ * BUDDY_INIT_THREADS_MAX allows.
+ */
+void test_buddy_parallel_prefault(void)
+{
+  fprintf(stderr, "->Test prefaulting with several threads\n");
+  struct buddy_options opts[] = {
+    { .flags = BUDDY_PREFAULT, .init_threads = 4 },
+    { .flags = BUDDY_PREFAULT | BUDDY_NO_HEADER, .init_threads = 3 },
+    { .flags = BUDDY_PREFAULT, .arenas = 4, .init_threads = BUDDY_INIT_THREADS_PER_CPU },
+    { .flags = BUDDY_PREFAULT, .arenas = 16, .init_threads = 16 },
+    { .flags = BUDDY_PREFAULT, .init_threads = 1000 },
+  };
+  for (size_t o = 0; o < sizeof(opts) / sizeof(opts[0]); o++)
+    {
+      struct buddy_pool pool;
+      buddy_init_opts(&pool, UINT64_C(1) << 25, &opts[o]);
+      assert(count_resident_pages(&pool) == pool.numbytes >> 12);
+      void *p = buddy_malloc(&pool, 1 << 20);
+      assert(p != NULL);
+      memset(p, 1, 1 << 20);
+      buddy_free(&pool, p);
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * A linked list kept in a file pool, linked by offsets from the base.
+ */
+struct file_node
+{
+  uint64_t next;
+  uint64_t value;
+};
+
+/**
+ * Build a list in a file pool, reattach it, let a child take a block and
+ * exit without closing it, and refuse files that do not hold a pool.
+ */
+void test_buddy_file(void)
+{
+  fprintf(stderr, "->Test pools kept in a file\n");
+  char path[] = "/tmp/buddy-test-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  //A new pool in the empty file
+  struct buddy_pool pool;
+  assert(buddy_init_file(&pool, path, 1 << MIN_K) == 0);
+  assert(pool.flags & BUDDY_NO_HEADER);
+  assert(buddy_file_root(&pool) == NULL);
+  uint64_t head = 0;
+  for (uint64_t i = 1; i <= 100; i++)
+    {
+      struct file_node *n = buddy_malloc(&pool, sizeof(*n));
+      assert(n != NULL);
+      n->value = i;
+      n->next = head;
+      head = (uint64_t)((char *)n - (char *)pool.base) + 1;
+    }
+  buddy_file_set_root(&pool, (char *)pool.base + head - 1);
+  void *big = buddy_malloc(&pool, 1 << 18);
+  assert(big != NULL);
+  buddy_free(&pool, big);
+  assert(buddy_sync(&pool) == 0);
+  buddy_destroy(&pool);
+
+  //Reattach and walk the list, then let a child die with the pool open
+  for (int round = 0; round < 2; round++)
+    {
+      assert(buddy_init_file(&pool, path, 0) == 0);
+      struct file_node *n = buddy_file_root(&pool);
+      uint64_t expect = 100, sum = 0;
+      while (n)
+        {
+          assert(n->value == expect--);
+          sum += n->value;
+          n = n->next ? (struct file_node *)((char *)pool.base + n->next - 1) : NULL;
+        }
+      assert(sum == 5050);
+      assert(pool.nfree[MIN_K] == 0);
+      if (round == 0)
+        {
+          //The nodes are still taken, the upper half is free
+          assert(pool.avail_bits & (UINT64_C(1) << (MIN_K - 1)));
+          buddy_destroy(&pool);
+          pid_t pid = fork();
+          assert(pid >= 0);
+          if (pid == 0)
+            {
+              struct buddy_pool child;
+              if (buddy_init_file(&child, path, 0) != 0 || !buddy_malloc(&child, 1 << 19))
+                {
+                  _exit(1);
+                }
+              _exit(0);
+            }
+          int status;
+          assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+    }
+
+  //The block the child took is still taken, recounted from the bitmaps
+  assert(!(pool.avail_bits & (UINT64_C(1) << (MIN_K - 1))));
+  void *nodes[100];
+  size_t count = 0;
+  for (struct file_node *n = buddy_file_root(&pool); n;
+       n = n->next ? (struct file_node *)((char *)pool.base + n->next - 1) : NULL)
+    {
+      nodes[count++] = n;
+    }
+  for (size_t i = 0; i < count; i++)
+    {
+      buddy_free(&pool, nodes[i]);
+    }
+  buddy_destroy(&pool);
+
+  //A size that does not match and a file that is not a pool are refused
+  assert(buddy_init_file(&pool, path, 1 << (MIN_K + 1)) == -1 && errno == EINVAL);
+  fd = open(path, O_WRONLY | O_TRUNC);
+  assert(fd >= 0);
+  assert(write(fd, "not a pool", 10) == 10);
+  close(fd);
+  assert(buddy_init_file(&pool, path, 0) == -1 && errno == EINVAL);
+  unlink(path);
+}
+
+/**
+ * Forked processes allocate from one shared pool at once, and a process
+ * that maps the pool from its fd hands a block back by its offset.
+ */
+void test_buddy_shared(void)
+{
+  fprintf(stderr, "->Test a pool shared between processes\n");
+  struct buddy_pool pool;
+  int fd = buddy_init_shared(&pool, UINT64_C(1) << 22);
+  assert(fd >= 0);
+  assert(pool.flags & BUDDY_SHARED);
+
+  //Forked workers allocate and free from the same pool at once
+  pid_t pids[4];
+  for (int w = 0; w < 4; w++)
+    {
+      pids[w] = fork();
+      assert(pids[w] >= 0);
+      if (pids[w] == 0)
+        {
+          unsigned int seed = (unsigned int)w;
+          char *held[64] = { 0 };
+          for (int i = 0; i < 20000; i++)
+            {
+              int slot = rand_r(&seed) % 64;
+              if (held[slot])
+                {
+                  for (size_t j = 0; j < 64; j++)
+                    {
+                      if (held[slot][j] != (char)(w + 1))
+                        {
+                          _exit(1);
+                        }
+                    }
+                  buddy_free(&pool, held[slot]);
+                  held[slot] = NULL;
+                }
+              else if ((held[slot] = buddy_malloc(&pool, 64 << (rand_r(&seed) % 8))))
+                {
+                  memset(held[slot], w + 1, 64);
+                }
+            }
+          for (int slot = 0; slot < 64; slot++)
+            {
+              buddy_free(&pool, held[slot]);
+            }
+          _exit(0);
+        }
+    }
+  for (int w = 0; w < 4; w++)
+    {
+      int status;
+      assert(waitpid(pids[w], &status, 0) == pids[w] && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+  //A process that maps the pool from the fd hands a block over by offset
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0)
+    {
+      struct buddy_pool other;
+      if (buddy_attach_shared(&other, fd) != 0)
+        {
+          _exit(1);
+        }
+      char *msg = buddy_malloc(&other, 100);
+      if (!msg)
+        {
+          _exit(1);
+        }
+      strcpy(msg, "handed over");
+      buddy_file_set_root(&other, msg);
+      buddy_destroy(&other);
+      _exit(0);
+    }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  char *msg = buddy_file_root(&pool);
+  assert(msg != NULL && strcmp(msg, "handed over") == 0);
+  buddy_free(&pool, msg);
+
+  //Freeing the last block loaded the counters the workers left behind
+  check_buddy_pool_full_ool(&pool);
+  close(fd);
+  buddy_destroy(&pool);
+
+  struct buddy_pool bad;
+  int null_fd = open("/dev/null", O_RDONLY);
+  assert(buddy_attach_shared(&bad, null_fd) == -1 && errno == EINVAL);
+  close(null_fd);
+
+  //Only buddy_init_shared makes a shared pool, the option is ignored
+  struct buddy_options opts = { .flags = BUDDY_SHARED | BUDDY_NO_HEADER };
+  buddy_init_opts(&pool, 1 << MIN_K, &opts);
+  assert(!(pool.flags & BUDDY_SHARED) && (pool.flags & BUDDY_NO_HEADER));
+  msg = buddy_malloc(&pool, 100);
+  assert(msg != NULL);
+  buddy_free(&pool, msg);
+  check_buddy_pool_full_ool(&pool);
+  buddy_destroy(&pool);
+}
+
+/**
+ * Encode and decode 32 bit handles in every header mode and walk a list
+ * linked by handles.
+ */
+void test_buddy_handles(void)
+{
+  fprintf(stderr, "->Test 32 bit handles\n");
+  struct buddy_pool fake;
+  memset(&fake, 0, sizeof(fake));
+  fake.kval_m = 37;
+  assert(buddy_handle_shift(&fake) == SMALLEST_K);
+  fake.kval_m = 40;
+  assert(buddy_handle_shift(&fake) == 9);
+
+  unsigned int flags[] = { 0, BUDDY_NO_HEADER, BUDDY_NO_HEADER | BUDDY_SLAB };
+  for (size_t f = 0; f < 3; f++)
+    {
+      struct buddy_pool pool;
+      struct buddy_options opts = { .flags = flags[f] };
+      buddy_init_opts(&pool, 0, &opts);
+      assert(buddy_handle_decode(&pool, BUDDY_HANDLE_NULL) == NULL);
+      assert(buddy_handle_encode(&pool, NULL) == BUDDY_HANDLE_NULL);
 
+      //A list linked by handles, 4 bytes a link
+      struct hnode
+      {
+        buddy_handle32_t next;
+        uint32_t value;
+      };
+      buddy_handle32_t head = BUDDY_HANDLE_NULL;
+      for (uint32_t i = 0; i < 1000; i++)
+        {
+          buddy_handle32_t h = i % 2 ? buddy_malloc_handle(&pool, sizeof(struct hnode))
+                                     : buddy_calloc_handle(&pool, 1, sizeof(struct hnode));
+          assert(h != BUDDY_HANDLE_NULL);
+          struct hnode *n = buddy_handle_decode(&pool, h);
+          assert(buddy_handle_encode(&pool, n) == h);
+          n->value = i;
+          n->next = head;
+          head = h;
+        }
+      uint32_t expect = 1000;
+      while (head != BUDDY_HANDLE_NULL)
+        {
+          struct hnode *n = buddy_handle_decode(&pool, head);
+          assert(n->value == --expect);
+          buddy_handle32_t next = n->next;
+          buddy_free_handle(&pool, head);
+          head = next;
+        }
+      assert(expect == 0);
 
+      //Plain allocations of whole blocks encode as well
+      void *p = buddy_malloc(&pool, 5000);
+      assert(buddy_handle_decode(&pool, buddy_handle_encode(&pool, p)) == p);
+      buddy_free(&pool, p);
+      errno = 0;
+      assert(buddy_malloc_handle(&pool, (size_t)1 << 40) == BUDDY_HANDLE_NULL && errno == ENOMEM);
 
+      if (pool.flags & BUDDY_NO_HEADER)
+        {
+          check_buddy_pool_full_ool(&pool);
+        }
+      else
+        {
+          check_buddy_pool_full(&pool);
+        }
+      buddy_destroy(&pool);
+    }
+}
+
+/**
+ * buddy_usable_size reports the whole block, slab object or mapping behind
+ * a pointer, and buddy_owns tells pool pointers from foreign ones.
+ */
+void test_buddy_usable_size(void)
+{
+  fprintf(stderr, "->Test usable size\n");
+  struct buddy_pool pool;
+  buddy_init(&pool, 0);
+  assert(buddy_usable_size(&pool, NULL) == 0);
+  //With a header a 100 byte request gets the rest of a 128 byte block
+  char *p = buddy_malloc(&pool, 100);
+  assert(buddy_usable_size(&pool, p) == 128 - sizeof(struct avail));
+  memset(p, 1, buddy_usable_size(&pool, p));
+  buddy_free(&pool, p);
+  check_buddy_pool_full(&pool);
+  buddy_destroy(&pool);
+
+  struct buddy_options opts = { .flags = BUDDY_NO_HEADER | BUDDY_SLAB,
+                                .mmap_threshold = (size_t)1 << 20 };
+  buddy_init_opts(&pool, 0, &opts);
+  p = buddy_malloc(&pool, 20);
+  assert(buddy_usable_size(&pool, p) == 24);
+  char *q = buddy_malloc(&pool, 3000);
+  assert(buddy_usable_size(&pool, q) == 4096);
+  char *big = buddy_malloc(&pool, ((size_t)1 << 20) + 1);
+  size_t cap = buddy_usable_size(&pool, big);
+  assert(cap > ((size_t)1 << 20) && cap % 4096 == 4096 - 64);
+  memset(big, 1, cap);
+  //Foreign pointers are told apart, even when they look like a mapping
+  assert(buddy_owns(&pool, p) && buddy_owns(&pool, q) && buddy_owns(&pool, big));
+  char *other = mmap(NULL, 8192, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(!buddy_owns(&pool, other + 64) && !buddy_owns(&pool, &cap) && !buddy_owns(&pool, NULL));
+  munmap(other, 8192);
+  buddy_free(&pool, big);
+  assert(!buddy_owns(&pool, big));
+  buddy_free(&pool, q);
+  buddy_free(&pool, p);
+  //The empty slab stays cached, so the pool is not full again
+  buddy_destroy(&pool);
+}
 
 int main(void) {
   time_t t;
@@ -178,5 +1713,31 @@ int main(void) {
   RUN_TEST(test_buddy_malloc_one_byte);
   RUN_TEST(test_buddy_malloc_one_large);
   RUN_TEST(test_buddy_alloc_free_two_blocks);
+  RUN_TEST(test_buddy_avail_bits);
+  RUN_TEST(test_buddy_out_of_line);
+  RUN_TEST(test_buddy_no_header);
+  RUN_TEST(test_buddy_thread_cache);
+  RUN_TEST(test_buddy_arenas);
+  RUN_TEST(test_buddy_lock_free);
+  RUN_TEST(test_buddy_slab);
+  RUN_TEST(test_buddy_malloc_batch);
+  RUN_TEST(test_buddy_free_batch);
+  RUN_TEST(test_buddy_realloc_grow);
+  RUN_TEST(test_buddy_realloc_shrink);
+  RUN_TEST(test_buddy_memalign);
+  RUN_TEST(test_buddy_slab_aligned_tag);
+  RUN_TEST(test_buddy_calloc);
+  RUN_TEST(test_buddy_mmap_threshold);
+  RUN_TEST(test_buddy_regions);
+  RUN_TEST(test_buddy_free_batch_trees);
+  RUN_TEST(test_buddy_purge);
+  RUN_TEST(test_buddy_purge_decay);
+  RUN_TEST(test_buddy_huge_pages);
+  RUN_TEST(test_buddy_prefault);
+  RUN_TEST(test_buddy_parallel_prefault);
+  RUN_TEST(test_buddy_file);
+  RUN_TEST(test_buddy_shared);
+  RUN_TEST(test_buddy_handles);
+  RUN_TEST(test_buddy_usable_size);
 return UNITY_END();
 }
\ No newline at end of file
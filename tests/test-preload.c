@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "harness/unity.h"
+
+/*
+ * Tests of the malloc replacement. make check runs them with
+ * LD_PRELOAD=./libbuddy.so, and they are built without the sanitizer,
+ * which would bring a malloc of its own.
+ */
+
+// glibc's own allocator, still there underneath the replacement
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+
+
+void setUp(void) {
+  // set stuff up here
+}
+
+void tearDown(void) {
+  // clean stuff up here
+}
+
+/**
+ * realloc of memory the pool never handed out must move it into the pool
+ * and leave the old block alone, even when the new size reaches past the
+ * mapping the old block lives in.
+ */
+void test_preload_realloc_foreign(void)
+{
+  fprintf(stderr, "->Test realloc of pointers from outside the pool\n");
+  char *old = __libc_malloc(100);
+  assert(old != NULL);
+  memset(old, 7, 100);
+  char *moved = realloc(old, 1 << 20);
+  assert(moved != NULL && moved != old);
+  for (int i = 0; i < 100; i++)
+    {
+      assert(moved[i] == 7);
+    }
+  assert(malloc_usable_size(moved) >= (1 << 20));
+  memset(moved, 1, 1 << 20);
+  free(moved);
+  __libc_free(old);
+
+  //Only what is mapped behind the pointer is copied
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  char *map = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(map != MAP_FAILED);
+  munmap(map + page, page);
+  char *tail = map + page - 16;
+  memset(tail, 3, 16);
+  moved = realloc(tail, 4 * page);
+  assert(moved != NULL);
+  for (int i = 0; i < 16; i++)
+    {
+      assert(moved[i] == 3);
+    }
+  free(moved);
+  munmap(map, page);
+}
+
+static volatile int churn_stop;
+
+/**
+ * Worker for test_preload_fork. Allocates, grows and frees blocks of every
+ * size the pool serves until churn_stop is set.
+ */
+static void *churn_worker(void *arg)
+{
+  unsigned int seed = (unsigned int)(uintptr_t)arg;
+  void *held[64] = { 0 };
+  while (!churn_stop)
+    {
+      int slot = rand_r(&seed) % 64;
+      if (held[slot] && rand_r(&seed) % 2)
+        {
+          held[slot] = realloc(held[slot], (size_t)1 << (4 + rand_r(&seed) % 16));
+        }
+      else
+        {
+          free(held[slot]);
+          held[slot] = malloc((size_t)1 << (4 + rand_r(&seed) % 16));
+        }
+      assert(held[slot] != NULL);
+    }
+  for (int slot = 0; slot < 64; slot++)
+    {
+      free(held[slot]);
+    }
+  return NULL;
+}
+
+/**
+ * Fork over and over while other threads churn the pool. Each child must
+ * still be able to allocate, a lock left held by a thread that did not
+ * make it into the child would hang it until the alarm kills it.
+ */
+void test_preload_fork(void)
+{
+  fprintf(stderr, "->Test fork while other threads allocate\n");
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++)
+    {
+      assert(pthread_create(&threads[i], NULL, churn_worker, (void *)(uintptr_t)(i + 1)) == 0);
+    }
+  for (int round = 0; round < 200; round++)
+    {
+      pid_t pid = fork();
+      assert(pid >= 0);
+      if (pid == 0)
+        {
+          alarm(5);
+          for (int i = 0; i < 100; i++)
+            {
+              char *p = malloc((size_t)1 << (4 + i % 16));
+              if (!p)
+                {
+                  _exit(1);
+                }
+              memset(p, 1, 16);
+              p = realloc(p, (size_t)1 << (4 + (i + 3) % 16));
+              free(p);
+            }
+          _exit(0);
+        }
+      int status;
+      assert(waitpid(pid, &status, 0) == pid);
+      assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+      usleep(1000);
+    }
+  churn_stop = 1;
+  for (int i = 0; i < 4; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+}
+
+int main(void) {
+  printf("Running malloc replacement tests.\n");
+
+  UNITY_BEGIN();
+  RUN_TEST(test_preload_realloc_foreign);
+  RUN_TEST(test_preload_fork);
+return UNITY_END();
+}